@@ -0,0 +1,35 @@
+#ifndef _NGX_GUILE_STRING_INCLUDED_
+#define _NGX_GUILE_STRING_INCLUDED_
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+// ngx must be included first
+#include <libguile.h>
+
+/* Shared by the http and stream modules */
+
+static ngx_inline SCM
+scm_from_ngx_string (ngx_str_t str)
+{
+  return scm_from_locale_stringn ((char *)str.data, str.len);
+}
+
+#endif /* _NGX_GUILE_STRING_INCLUDED_ */
@@ -0,0 +1,934 @@
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include "ngx_http_guile_body.h"
+// module declaration and request context
+#include "ngx_http_guile_request.h"
+#include "ngx_guile_string.h"
+
+/* Bytes of a body buffered in the client body temp file read at once. It
+   also bounds the header block of a multipart part. */
+#define NGX_HTTP_GUILE_BODY_WINDOW 16384
+
+/* A form field. Values are ranges of the request body, read when they are
+   accessed: urlencoded values are then decoded, file parts are copied to
+   a temporary file. */
+typedef struct
+{
+  ngx_str_t name;
+  ngx_str_t filename;
+  ngx_str_t content_type;
+  ngx_str_t path;
+
+  /* the value in the body, and its copy once accessed */
+  off_t offset;
+  size_t len;
+  ngx_str_t value;
+
+  unsigned encoded : 1;
+  unsigned file : 1;
+} ngx_http_guile_form_field_t;
+
+/* The request body chain read by offset. Ranges within one memory buffer
+   are used in place, others are read into a window, so that a body
+   buffered in a file is never held in memory at once. */
+typedef struct
+{
+  ngx_http_request_t *r;
+  off_t len;
+
+  /* buffer of the last offset read and its offset in the body */
+  ngx_chain_t *cl;
+  off_t cl_start;
+
+  u_char *window;
+  off_t window_start;
+  size_t window_len;
+} ngx_http_guile_body_t;
+
+typedef struct ngx_http_guile_form_s
+{
+  ngx_array_t fields;
+  ngx_http_guile_body_t body;
+} ngx_http_guile_form_t;
+
+static void ngx_http_guile_body_handler (ngx_http_request_t *r);
+static ngx_http_guile_form_t *ngx_http_guile_form (ngx_http_request_t *r);
+static u_char *ngx_http_guile_body_peek (ngx_http_guile_body_t *body,
+                                         off_t offset, size_t min, size_t *n);
+static ngx_int_t ngx_http_guile_body_find (ngx_http_guile_body_t *body,
+                                           off_t from, off_t to, u_char *s,
+                                           size_t len, off_t *found);
+static ngx_int_t ngx_http_guile_body_match (ngx_http_guile_body_t *body,
+                                            off_t offset, u_char *s,
+                                            size_t len);
+static ngx_int_t ngx_http_guile_body_string (ngx_http_guile_body_t *body,
+                                             off_t offset, size_t len,
+                                             ngx_str_t *s);
+static ngx_int_t
+ngx_http_guile_form_parse_urlencoded (ngx_http_guile_form_t *form);
+static ngx_int_t
+ngx_http_guile_form_parse_multipart (ngx_http_guile_form_t *form,
+                                     ngx_str_t *boundary);
+static void ngx_http_guile_form_part_headers (ngx_http_guile_form_field_t *f,
+                                              u_char *p, u_char *last);
+static u_char *ngx_http_guile_form_param (u_char *p, u_char *last,
+                                          ngx_str_t *key, ngx_str_t *value);
+static u_char *ngx_http_guile_form_find (u_char *p, u_char *last, u_char *s,
+                                         size_t len);
+static ngx_int_t ngx_http_guile_form_decode (ngx_pool_t *pool, ngx_str_t *s);
+static ngx_int_t ngx_http_guile_form_spill (ngx_http_guile_form_t *form,
+                                            ngx_http_guile_form_field_t *f);
+static ngx_http_guile_form_field_t *
+ngx_http_guile_form_lookup (ngx_array_t *fields, SCM name, const char *subr);
+
+/* Phase handler helper */
+
+/* Read the whole body before Scheme runs, the way ngx_http_mirror_module
+   does. Returns NGX_OK when the body is available and NGX_DONE while it is
+   being read, the body handler then runs the phases again. */
+ngx_int_t
+ngx_http_guile_read_body (ngx_http_request_t *r)
+{
+  ngx_http_guile_ctx_t *ctx;
+  ngx_int_t rc;
+
+  // subrequests see the body of the main request
+  if (r != r->main)
+    return NGX_OK;
+
+  ctx = ngx_http_guile_get_ctx (r);
+  if (ctx == NULL)
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  if (ctx->body_read)
+    return NGX_OK;
+
+  if (ctx->body_requested)
+    return NGX_DONE;
+
+  ctx->body_requested = 1;
+
+  // lets the parsers work in place on bodies that fit in memory, larger
+  // ones are buffered in a file and read by window
+  r->request_body_in_single_buf = 1;
+
+  rc = ngx_http_read_client_request_body (r, ngx_http_guile_body_handler);
+  if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
+    return rc;
+
+  ngx_http_finalize_request (r, NGX_DONE);
+
+  return NGX_DONE;
+}
+
+static void
+ngx_http_guile_body_handler (ngx_http_request_t *r)
+{
+  ngx_http_guile_ctx_t *ctx;
+
+  ctx = ngx_http_get_module_ctx (r, ngx_http_guile_module);
+  ctx->body_read = 1;
+
+  // the body may still be needed by a proxied content handler
+  r->preserve_body = 1;
+
+  r->write_event_handler = ngx_http_core_run_phases;
+  ngx_http_core_run_phases (r);
+}
+
+/* Accessors */
+
+SCM
+ngx_http_guile_request_form_fields (SCM http_request)
+{
+  ngx_http_guile_form_field_t *f;
+  ngx_http_guile_form_t *form;
+  ngx_uint_t i;
+  SCM names;
+
+  form = ngx_http_guile_form (ngx_http_guile_request_unwrap (http_request));
+
+  f = form->fields.elts;
+  names = SCM_EOL;
+
+  for (i = form->fields.nelts; i > 0; i--)
+    names = scm_cons (scm_from_ngx_string (f[i - 1].name), names);
+
+  return names;
+}
+
+SCM
+ngx_http_guile_request_form_ref (SCM http_request, SCM name)
+{
+  ngx_http_guile_form_field_t *f;
+  ngx_http_guile_form_t *form;
+  ngx_http_request_t *r;
+
+  r = ngx_http_guile_request_unwrap (http_request);
+  form = ngx_http_guile_form (r);
+
+  f = ngx_http_guile_form_lookup (&form->fields, name, "ngx-request-form-ref");
+
+  // file contents are reached through ngx-request-form-file
+  if (f == NULL || f->file)
+    return SCM_BOOL_F;
+
+  if (f->value.data == NULL
+      && ngx_http_guile_body_string (&form->body, f->offset, f->len,
+                                     &f->value)
+             != NGX_OK)
+    scm_misc_error ("ngx-request-form-ref", "cannot read request body",
+                    SCM_EOL);
+
+  if (f->encoded)
+    {
+      if (ngx_http_guile_form_decode (r->pool, &f->value) != NGX_OK)
+        scm_memory_error ("ngx-request-form-ref");
+
+      f->encoded = 0;
+    }
+
+  return scm_from_ngx_string (f->value);
+}
+
+SCM
+ngx_http_guile_request_form_file (SCM http_request, SCM name)
+{
+  ngx_http_guile_form_field_t *f;
+  ngx_http_guile_form_t *form;
+
+  form = ngx_http_guile_form (ngx_http_guile_request_unwrap (http_request));
+
+  f = ngx_http_guile_form_lookup (&form->fields, name,
+                                  "ngx-request-form-file");
+
+  if (f == NULL || !f->file)
+    return SCM_BOOL_F;
+
+  if (f->path.data == NULL && ngx_http_guile_form_spill (form, f) != NGX_OK)
+    scm_misc_error ("ngx-request-form-file",
+                    "cannot write form part ~S to a temporary file",
+                    scm_list_1 (name));
+
+  return scm_list_4 (
+      scm_cons (scm_from_utf8_symbol ("filename"),
+                scm_from_ngx_string (f->filename)),
+      scm_cons (scm_from_utf8_symbol ("content-type"),
+                f->content_type.data ? scm_from_ngx_string (f->content_type)
+                                     : SCM_BOOL_F),
+      scm_cons (scm_from_utf8_symbol ("path"), scm_from_ngx_string (f->path)),
+      scm_cons (scm_from_utf8_symbol ("size"),
+                scm_from_size_t (f->len)));
+}
+
+/* Local helpers impl */
+
+/* Fields of the request body, parsed on first access and kept in the
+   request context */
+static ngx_http_guile_form_t *
+ngx_http_guile_form (ngx_http_request_t *r)
+{
+  ngx_http_guile_ctx_t *ctx;
+  ngx_http_guile_form_t *form;
+  ngx_chain_t *cl;
+  ngx_table_elt_t *h;
+  ngx_str_t key, value, boundary;
+  u_char *p, *last;
+  ngx_int_t rc;
+
+  ctx = ngx_http_guile_get_ctx (r);
+  if (ctx == NULL)
+    scm_memory_error ("ngx_http_guile_get_ctx");
+
+  if (ctx->form)
+    return ctx->form;
+
+  if (r->request_body == NULL)
+    scm_misc_error ("ngx-request-form",
+                    "request body not read, see guile_read_body", SCM_EOL);
+
+  form = ngx_pcalloc (r->pool, sizeof (ngx_http_guile_form_t));
+  if (form == NULL
+      || ngx_array_init (&form->fields, r->pool, 8,
+                         sizeof (ngx_http_guile_form_field_t))
+             != NGX_OK)
+    scm_memory_error ("ngx-request-form");
+
+  form->body.r = r;
+
+  for (cl = r->request_body->bufs; cl; cl = cl->next)
+    form->body.len += ngx_buf_size (cl->buf);
+
+  h = r->headers_in.content_type;
+  rc = NGX_OK;
+
+  if (h && form->body.len)
+    {
+      p = h->value.data;
+      last = h->value.data + h->value.len;
+
+      if (h->value.len >= 33
+          && ngx_strncasecmp (p, (u_char *)"application/x-www-form-urlencoded",
+                              33)
+                 == 0)
+        {
+          rc = ngx_http_guile_form_parse_urlencoded (form);
+        }
+      else if (h->value.len >= 19
+               && ngx_strncasecmp (p, (u_char *)"multipart/form-data", 19)
+                      == 0)
+        {
+          ngx_str_null (&boundary);
+
+          p += 19;
+
+          while ((p = ngx_http_guile_form_param (p, last, &key, &value))
+                 != NULL)
+            {
+              if (key.len == 8
+                  && ngx_strncasecmp (key.data, (u_char *)"boundary", 8) == 0)
+                boundary = value;
+            }
+
+          rc = boundary.len
+                   ? ngx_http_guile_form_parse_multipart (form, &boundary)
+                   : NGX_DECLINED;
+        }
+    }
+
+  if (rc == NGX_ERROR)
+    scm_misc_error ("ngx-request-form", "cannot read request body", SCM_EOL);
+
+  // keep what was parsed, scripts see the fields before the error
+  if (rc == NGX_DECLINED)
+    ngx_log_error (NGX_LOG_INFO, r->connection->log, 0,
+                   "client sent malformed form body");
+
+  ctx->form = form;
+
+  return form;
+}
+
+/* At least min bytes of the body at offset, fewer only at its end, min
+   being at most the window size. n is set to the bytes available at the
+   returned address. */
+static u_char *
+ngx_http_guile_body_peek (ngx_http_guile_body_t *body, off_t offset,
+                          size_t min, size_t *n)
+{
+  ngx_chain_t *cl;
+  ngx_buf_t *b;
+  off_t start, size, skip;
+  u_char *p, *last;
+  size_t len;
+  ssize_t rc;
+
+  min = (size_t)ngx_min ((off_t)min, body->len - offset);
+
+  // the chain is walked forward from the buffer of the last offset read
+  if (body->cl == NULL || offset < body->cl_start)
+    {
+      body->cl = body->r->request_body->bufs;
+      body->cl_start = 0;
+    }
+
+  while (offset >= body->cl_start + ngx_buf_size (body->cl->buf))
+    {
+      body->cl_start += ngx_buf_size (body->cl->buf);
+      body->cl = body->cl->next;
+    }
+
+  b = body->cl->buf;
+  size = ngx_buf_size (b);
+
+  if (ngx_buf_in_memory (b) && body->cl_start + size - offset >= (off_t)min)
+    {
+      *n = (size_t)(body->cl_start + size - offset);
+      return b->pos + (offset - body->cl_start);
+    }
+
+  if (body->window && offset >= body->window_start
+      && body->window_start + (off_t)body->window_len - offset >= (off_t)min)
+    {
+      *n = (size_t)(body->window_start + body->window_len - offset);
+      return body->window + (offset - body->window_start);
+    }
+
+  if (body->window == NULL)
+    {
+      body->window = ngx_pnalloc (body->r->pool, NGX_HTTP_GUILE_BODY_WINDOW);
+      if (body->window == NULL)
+        return NULL;
+    }
+
+  len = (size_t)ngx_min ((off_t)NGX_HTTP_GUILE_BODY_WINDOW,
+                         body->len - offset);
+
+  p = body->window;
+  last = body->window + len;
+  cl = body->cl;
+  start = body->cl_start;
+
+  for (/* void */; p < last; cl = cl->next)
+    {
+      b = cl->buf;
+      size = ngx_buf_size (b);
+
+      skip = offset + (p - body->window) - start;
+      start += size;
+
+      size = ngx_min (size - skip, (off_t)(last - p));
+
+      if (ngx_buf_in_memory (b))
+        {
+          p = ngx_cpymem (p, b->pos + skip, (size_t)size);
+          continue;
+        }
+
+      rc = ngx_read_file (b->file, p, (size_t)size, b->file_pos + skip);
+      if (rc != size)
+        return NULL;
+
+      p += size;
+    }
+
+  body->window_start = offset;
+  body->window_len = len;
+
+  *n = len;
+
+  return body->window;
+}
+
+/* First occurrence of s in the body between from and to, NGX_DECLINED
+   when there is none */
+static ngx_int_t
+ngx_http_guile_body_find (ngx_http_guile_body_t *body, off_t from, off_t to,
+                          u_char *s, size_t len, off_t *found)
+{
+  u_char *p, *q;
+  size_t n;
+
+  while (to - from >= (off_t)len)
+    {
+      p = ngx_http_guile_body_peek (body, from, len, &n);
+      if (p == NULL)
+        return NGX_ERROR;
+
+      if ((off_t)n > to - from)
+        n = (size_t)(to - from);
+
+      q = ngx_http_guile_form_find (p, p + n, s, len);
+      if (q)
+        {
+          *found = from + (q - p);
+          return NGX_OK;
+        }
+
+      // an occurrence may start in the last len - 1 bytes
+      from += n - (len - 1);
+    }
+
+  return NGX_DECLINED;
+}
+
+/* Whether the body has s at offset */
+static ngx_int_t
+ngx_http_guile_body_match (ngx_http_guile_body_t *body, off_t offset,
+                           u_char *s, size_t len)
+{
+  u_char *p;
+  size_t n;
+
+  if (body->len - offset < (off_t)len)
+    return NGX_DECLINED;
+
+  p = ngx_http_guile_body_peek (body, offset, len, &n);
+  if (p == NULL)
+    return NGX_ERROR;
+
+  return ngx_memcmp (p, s, len) == 0 ? NGX_OK : NGX_DECLINED;
+}
+
+/* len bytes of the body at offset, in place when they are in one memory
+   buffer and copied to the request pool otherwise */
+static ngx_int_t
+ngx_http_guile_body_string (ngx_http_guile_body_t *body, off_t offset,
+                            size_t len, ngx_str_t *s)
+{
+  u_char *p, *dst;
+  size_t n;
+
+  s->len = len;
+
+  if (len == 0)
+    {
+      s->data = (u_char *)"";
+      return NGX_OK;
+    }
+
+  p = ngx_http_guile_body_peek (body, offset, 1, &n);
+  if (p == NULL)
+    return NGX_ERROR;
+
+  // the window is reused by the next read
+  if (n >= len
+      && (p < body->window || p >= body->window + NGX_HTTP_GUILE_BODY_WINDOW))
+    {
+      s->data = p;
+      return NGX_OK;
+    }
+
+  dst = ngx_pnalloc (body->r->pool, len);
+  if (dst == NULL)
+    return NGX_ERROR;
+
+  s->data = dst;
+
+  for (;;)
+    {
+      n = ngx_min (n, len);
+      dst = ngx_cpymem (dst, p, n);
+
+      offset += n;
+      len -= n;
+
+      if (len == 0)
+        return NGX_OK;
+
+      p = ngx_http_guile_body_peek (body, offset, 1, &n);
+      if (p == NULL)
+        return NGX_ERROR;
+    }
+}
+
+/* "name=value&name=value", names are decoded at once since every lookup
+   compares them, values only when they are accessed */
+static ngx_int_t
+ngx_http_guile_form_parse_urlencoded (ngx_http_guile_form_t *form)
+{
+  ngx_http_guile_body_t *body = &form->body;
+  ngx_http_guile_form_field_t *f;
+  off_t off, end, eq;
+  ngx_int_t rc;
+
+  for (off = 0; off < body->len; off = end + 1)
+    {
+      rc = ngx_http_guile_body_find (body, off, body->len, (u_char *)"&", 1,
+                                     &end);
+      if (rc == NGX_ERROR)
+        return NGX_ERROR;
+
+      if (rc == NGX_DECLINED)
+        end = body->len;
+
+      if (end == off)
+        continue;
+
+      rc = ngx_http_guile_body_find (body, off, end, (u_char *)"=", 1, &eq);
+      if (rc == NGX_ERROR)
+        return NGX_ERROR;
+
+      f = ngx_array_push (&form->fields);
+      if (f == NULL)
+        return NGX_ERROR;
+
+      ngx_memzero (f, sizeof (ngx_http_guile_form_field_t));
+
+      if (rc == NGX_DECLINED)
+        eq = end;
+
+      f->offset = eq < end ? eq + 1 : end;
+      f->len = (size_t)(end - f->offset);
+      f->encoded = 1;
+
+      if (ngx_http_guile_body_string (body, off, (size_t)(eq - off), &f->name)
+              != NGX_OK
+          || ngx_http_guile_form_decode (body->r->pool, &f->name) != NGX_OK)
+        return NGX_ERROR;
+    }
+
+  return NGX_OK;
+}
+
+/* RFC 7578 body. Returns NGX_DECLINED on a malformed body, with the fields
+   parsed so far. */
+static ngx_int_t
+ngx_http_guile_form_parse_multipart (ngx_http_guile_form_t *form,
+                                     ngx_str_t *boundary)
+{
+  ngx_http_guile_body_t *body = &form->body;
+  ngx_http_guile_form_field_t part, *f;
+  ngx_str_t headers;
+  off_t off, start, end;
+  ngx_int_t rc;
+  u_char *delim;
+  size_t len;
+
+  // CRLF "--" boundary, the first delimiter may open the body without CRLF
+  len = boundary->len + 4;
+
+  if (len > NGX_HTTP_GUILE_BODY_WINDOW)
+    return NGX_DECLINED;
+
+  delim = ngx_pnalloc (body->r->pool, len);
+  if (delim == NULL)
+    return NGX_ERROR;
+
+  ngx_memcpy (delim, CRLF "--", 4);
+  ngx_memcpy (delim + 4, boundary->data, boundary->len);
+
+  rc = ngx_http_guile_body_match (body, 0, delim + 2, len - 2);
+
+  if (rc == NGX_OK)
+    {
+      off = len - 2;
+    }
+  else
+    {
+      if (rc == NGX_DECLINED)
+        rc = ngx_http_guile_body_find (body, 0, body->len, delim, len, &off);
+
+      if (rc != NGX_OK)
+        return rc;
+
+      off += len;
+    }
+
+  for (;;)
+    {
+      // the close delimiter ends the body, the epilogue is ignored
+      rc = ngx_http_guile_body_match (body, off, (u_char *)"--", 2);
+      if (rc != NGX_DECLINED)
+        return rc;
+
+      // skip transport padding up to the end of the delimiter line
+      rc = ngx_http_guile_body_find (body, off, body->len, (u_char *)CRLF, 2,
+                                     &off);
+      if (rc != NGX_OK)
+        return rc;
+
+      off += 2;
+      start = off;
+
+      rc = ngx_http_guile_body_match (body, off, (u_char *)CRLF, 2);
+
+      if (rc == NGX_OK)
+        {
+          end = off;
+          off += 2;
+        }
+      else
+        {
+          // header blocks longer than the window are malformed
+          if (rc == NGX_DECLINED)
+            rc = ngx_http_guile_body_find (
+                body, off,
+                ngx_min (body->len, off + NGX_HTTP_GUILE_BODY_WINDOW),
+                (u_char *)CRLF CRLF, 4, &end);
+
+          if (rc != NGX_OK)
+            return rc;
+
+          off = end + 4;
+        }
+
+      ngx_memzero (&part, sizeof (ngx_http_guile_form_field_t));
+
+      if (ngx_http_guile_body_string (body, start, (size_t)(end - start),
+                                      &headers)
+          != NGX_OK)
+        return NGX_ERROR;
+
+      ngx_http_guile_form_part_headers (&part, headers.data,
+                                        headers.data + headers.len);
+
+      rc = ngx_http_guile_body_find (body, off, body->len, delim, len, &end);
+      if (rc != NGX_OK)
+        return rc;
+
+      part.offset = off;
+      part.len = (size_t)(end - off);
+
+      off = end + len;
+
+      // a part without a name cannot be looked up
+      if (part.name.data == NULL)
+        continue;
+
+      f = ngx_array_push (&form->fields);
+      if (f == NULL)
+        return NGX_ERROR;
+
+      *f = part;
+    }
+}
+
+/* Content-Disposition and Content-Type of a part, other headers are
+   ignored */
+static void
+ngx_http_guile_form_part_headers (ngx_http_guile_form_field_t *f, u_char *p,
+                                  u_char *last)
+{
+  ngx_str_t key, value;
+  u_char *end, *colon, *v;
+  size_t n;
+
+  for (/* void */; p < last; p = end + 2)
+    {
+      end = ngx_http_guile_form_find (p, last, (u_char *)CRLF, 2);
+      if (end == NULL)
+        end = last;
+
+      colon = ngx_strlchr (p, end, ':');
+      if (colon == NULL)
+        continue;
+
+      n = colon - p;
+
+      v = colon + 1;
+      while (v < end && (*v == ' ' || *v == '\t'))
+        v++;
+
+      if (n == 19
+          && ngx_strncasecmp (p, (u_char *)"Content-Disposition", 19) == 0)
+        {
+          while ((v = ngx_http_guile_form_param (v, end, &key, &value))
+                 != NULL)
+            {
+              if (key.len == 4
+                  && ngx_strncasecmp (key.data, (u_char *)"name", 4) == 0)
+                {
+                  f->name = value;
+                }
+              else if (key.len == 8
+                       && ngx_strncasecmp (key.data, (u_char *)"filename", 8)
+                              == 0)
+                {
+                  f->filename = value;
+                  f->file = 1;
+                }
+            }
+        }
+      else if (n == 12
+               && ngx_strncasecmp (p, (u_char *)"Content-Type", 12) == 0)
+        {
+          f->content_type.data = v;
+          f->content_type.len = end - v;
+        }
+    }
+}
+
+/* Next "; key=value" or "; key="value"" parameter of a header value,
+   NULL at the end. A token without '=' is returned with a null value. */
+static u_char *
+ngx_http_guile_form_param (u_char *p, u_char *last, ngx_str_t *key,
+                           ngx_str_t *value)
+{
+  while (p < last && (*p == ' ' || *p == '\t' || *p == ';'))
+    p++;
+
+  if (p == last)
+    return NULL;
+
+  key->data = p;
+
+  while (p < last && *p != '=' && *p != ';')
+    p++;
+
+  key->len = p - key->data;
+
+  ngx_str_null (value);
+
+  if (p == last || *p != '=')
+    return p;
+
+  p++;
+
+  if (p < last && *p == '"')
+    {
+      value->data = ++p;
+
+      while (p < last && *p != '"')
+        {
+          if (*p == '\\' && p + 1 < last)
+            p++;
+
+          p++;
+        }
+
+      value->len = p - value->data;
+
+      if (p < last)
+        p++;
+
+      return p;
+    }
+
+  value->data = p;
+
+  while (p < last && *p != ';' && *p != ' ' && *p != '\t')
+    p++;
+
+  value->len = p - value->data;
+
+  return p;
+}
+
+/* First occurrence of s in [p, last), the body is binary */
+static u_char *
+ngx_http_guile_form_find (u_char *p, u_char *last, u_char *s, size_t len)
+{
+  u_char *end;
+
+  if ((size_t)(last - p) < len)
+    return NULL;
+
+  end = last - len + 1;
+
+  while (p < end)
+    {
+      p = memchr (p, s[0], end - p);
+      if (p == NULL)
+        return NULL;
+
+      if (ngx_memcmp (p, s, len) == 0)
+        return p;
+
+      p++;
+    }
+
+  return NULL;
+}
+
+/* Decode '+' and %XX. Plain strings are left in place; others are decoded
+   in a copy, the body may still be sent upstream. */
+static ngx_int_t
+ngx_http_guile_form_decode (ngx_pool_t *pool, ngx_str_t *s)
+{
+  u_char *dst, *src, *p;
+  size_t i;
+
+  for (i = 0; i < s->len; i++)
+    {
+      if (s->data[i] == '%' || s->data[i] == '+')
+        break;
+    }
+
+  if (i == s->len)
+    return NGX_OK;
+
+  dst = ngx_pnalloc (pool, s->len);
+  if (dst == NULL)
+    return NGX_ERROR;
+
+  // ngx_unescape_uri does not know '+', replace it before %2B is decoded
+  for (i = 0; i < s->len; i++)
+    dst[i] = s->data[i] == '+' ? ' ' : s->data[i];
+
+  src = dst;
+  p = dst;
+
+  ngx_unescape_uri (&p, &src, s->len, 0);
+
+  s->data = dst;
+  s->len = p - dst;
+
+  return NGX_OK;
+}
+
+/* Copy a file part to a temporary file in client_body_temp_path, removed
+   with the request pool. A body buffered in a file is copied by window. */
+static ngx_int_t
+ngx_http_guile_form_spill (ngx_http_guile_form_t *form,
+                           ngx_http_guile_form_field_t *f)
+{
+  ngx_http_request_t *r = form->body.r;
+  ngx_http_core_loc_conf_t *clcf;
+  ngx_temp_file_t *tf;
+  off_t offset, written;
+  u_char *p;
+  size_t n;
+
+  clcf = ngx_http_get_module_loc_conf (r, ngx_http_core_module);
+
+  tf = ngx_pcalloc (r->pool, sizeof (ngx_temp_file_t));
+  if (tf == NULL)
+    return NGX_ERROR;
+
+  tf->file.fd = NGX_INVALID_FILE;
+  tf->file.log = r->connection->log;
+  tf->path = clcf->client_body_temp_path;
+  tf->pool = r->pool;
+  tf->log_level = r->request_body_file_log_level;
+  tf->clean = 1;
+
+  if (ngx_create_temp_file (&tf->file, tf->path, tf->pool, tf->persistent,
+                            tf->clean, tf->access)
+      != NGX_OK)
+    return NGX_ERROR;
+
+  offset = f->offset;
+
+  for (written = 0; written < (off_t)f->len; written += n)
+    {
+      p = ngx_http_guile_body_peek (&form->body, offset + written, 1, &n);
+      if (p == NULL)
+        return NGX_ERROR;
+
+      n = ngx_min (n, f->len - (size_t)written);
+
+      if (ngx_write_file (&tf->file, p, n, written) != (ssize_t)n)
+        return NGX_ERROR;
+    }
+
+  f->path = tf->file.name;
+
+  return NGX_OK;
+}
+
+/* First field named name, a string or a symbol */
+static ngx_http_guile_form_field_t *
+ngx_http_guile_form_lookup (ngx_array_t *fields, SCM name, const char *subr)
+{
+  ngx_http_guile_form_field_t *f;
+  ngx_uint_t i;
+  size_t len;
+  char *s;
+
+  if (scm_is_symbol (name))
+    name = scm_symbol_to_string (name);
+
+  SCM_ASSERT (scm_is_string (name), name, SCM_ARG2, subr);
+
+  s = scm_to_locale_stringn (name, &len);
+
+  f = fields->elts;
+
+  for (i = 0; i < fields->nelts; i++)
+    {
+      if (f[i].name.len == len && ngx_memcmp (f[i].name.data, s, len) == 0)
+        break;
+    }
+
+  free (s);
+
+  return i < fields->nelts ? &f[i] : NULL;
+}
@@ -0,0 +1,206 @@
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include "ngx_http_guile_breaker.h"
+// module declaration
+#include "ngx_http_guile_request.h"
+
+/* Shared state, updated with atomics only. Races between workers may count
+   a failure in the previous window, which is fine for a breaker. */
+typedef struct
+{
+  ngx_atomic_t failures;
+  ngx_atomic_t window_start;
+  ngx_atomic_t open_until;
+} ngx_http_guile_breaker_t;
+
+/* Tag of the breaker zones, nginx rejects a zone name reused with another
+   tag, such as the one of a guile_rate_limit_zone */
+static ngx_uint_t ngx_http_guile_breaker_tag;
+
+static ngx_int_t ngx_http_guile_breaker_init_zone (ngx_shm_zone_t *shm_zone,
+                                                   void *data);
+
+/* Configuration */
+
+/* guile_circuit_breaker zone=name failures=number window=time
+                         [status=code] | off */
+char *
+ngx_http_guile_breaker_conf (ngx_conf_t *cf,
+                             ngx_http_guile_breaker_conf_t **bcfp)
+{
+  ngx_http_guile_breaker_conf_t *bcf;
+  ngx_str_t *value, name, s;
+  ngx_uint_t i;
+  ngx_int_t n;
+
+  if (*bcfp != NGX_CONF_UNSET_PTR)
+    return "is duplicate";
+
+  value = cf->args->elts;
+
+  if (cf->args->nelts == 2 && ngx_strcmp (value[1].data, "off") == 0)
+    {
+      *bcfp = NULL;
+      return NGX_CONF_OK;
+    }
+
+  bcf = ngx_pcalloc (cf->pool, sizeof (ngx_http_guile_breaker_conf_t));
+  if (bcf == NULL)
+    return NGX_CONF_ERROR;
+
+  bcf->status = NGX_HTTP_SERVICE_UNAVAILABLE;
+  ngx_str_null (&name);
+
+  for (i = 1; i < cf->args->nelts; i++)
+    {
+      if (ngx_strncmp (value[i].data, "zone=", 5) == 0)
+        {
+          name.len = value[i].len - 5;
+          name.data = value[i].data + 5;
+          continue;
+        }
+
+      if (ngx_strncmp (value[i].data, "failures=", 9) == 0)
+        {
+          n = ngx_atoi (value[i].data + 9, value[i].len - 9);
+          if (n <= 0)
+            goto invalid;
+
+          bcf->failures = n;
+          continue;
+        }
+
+      if (ngx_strncmp (value[i].data, "window=", 7) == 0)
+        {
+          s.len = value[i].len - 7;
+          s.data = value[i].data + 7;
+
+          bcf->window = ngx_parse_time (&s, 1);
+          if (bcf->window == (time_t)NGX_ERROR || bcf->window == 0)
+            goto invalid;
+
+          continue;
+        }
+
+      if (ngx_strncmp (value[i].data, "status=", 7) == 0)
+        {
+          n = ngx_atoi (value[i].data + 7, value[i].len - 7);
+          if (n < 400 || n > 599)
+            goto invalid;
+
+          bcf->status = n;
+          continue;
+        }
+
+    invalid:
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                          &value[i]);
+      return NGX_CONF_ERROR;
+    }
+
+  if (name.len == 0 || bcf->failures == 0 || bcf->window == 0)
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                          "\"zone\", \"failures\" and \"window\" parameters "
+                          "are required");
+      return NGX_CONF_ERROR;
+    }
+
+  // the state needs a few bytes, the smallest zone nginx accepts is enough
+  bcf->zone = ngx_shared_memory_add (cf, &name, 8 * ngx_pagesize,
+                                     &ngx_http_guile_breaker_tag);
+  if (bcf->zone == NULL)
+    return NGX_CONF_ERROR;
+
+  bcf->zone->init = ngx_http_guile_breaker_init_zone;
+
+  *bcfp = bcf;
+
+  return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_guile_breaker_init_zone (ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_http_guile_breaker_t *breaker;
+  ngx_slab_pool_t *shpool;
+
+  // reload, keep the state of the previous cycle
+  if (data)
+    {
+      shm_zone->data = data;
+      return NGX_OK;
+    }
+
+  shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+  if (shm_zone->shm.exists)
+    {
+      shm_zone->data = shpool->data;
+      return NGX_OK;
+    }
+
+  breaker = ngx_slab_calloc (shpool, sizeof (ngx_http_guile_breaker_t));
+  if (breaker == NULL)
+    return NGX_ERROR;
+
+  shpool->data = breaker;
+  shm_zone->data = breaker;
+
+  return NGX_OK;
+}
+
+/* State */
+
+ngx_int_t
+ngx_http_guile_breaker_open (ngx_http_guile_breaker_conf_t *bcf)
+{
+  ngx_http_guile_breaker_t *breaker = bcf->zone->data;
+
+  return (time_t)breaker->open_until > ngx_time ();
+}
+
+/* Count a failure in the current window, opening the breaker for one
+   window when the threshold is reached */
+void
+ngx_http_guile_breaker_failure (ngx_http_guile_breaker_conf_t *bcf,
+                                ngx_log_t *log)
+{
+  ngx_http_guile_breaker_t *breaker = bcf->zone->data;
+  ngx_atomic_uint_t start;
+  time_t now;
+
+  now = ngx_time ();
+  start = breaker->window_start;
+
+  if (now - (time_t)start >= bcf->window
+      && ngx_atomic_cmp_set (&breaker->window_start, start, now))
+    breaker->failures = 0;
+
+  if (ngx_atomic_fetch_add (&breaker->failures, 1) + 1 < bcf->failures)
+    return;
+
+  breaker->open_until = now + bcf->window;
+  breaker->failures = 0;
+
+  ngx_log_error (NGX_LOG_WARN, log, 0,
+                 "guile circuit breaker \"%V\" open for %T seconds",
+                 &bcf->zone->shm.name, bcf->window);
+}
@@ -0,0 +1,47 @@
+#ifndef _NGX_HTTP_GUILE_BREAKER_INCLUDED_
+#define _NGX_HTTP_GUILE_BREAKER_INCLUDED_
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/* Circuit breaker of a location, its state lives in a shared memory zone
+   so that all workers see the same failures */
+typedef struct
+{
+  ngx_shm_zone_t *zone;
+  ngx_uint_t failures;
+  time_t window;
+  ngx_uint_t status;
+} ngx_http_guile_breaker_conf_t;
+
+/* Configuration */
+
+char *ngx_http_guile_breaker_conf (ngx_conf_t *cf,
+                                   ngx_http_guile_breaker_conf_t **bcfp);
+
+/* State */
+
+ngx_int_t ngx_http_guile_breaker_open (ngx_http_guile_breaker_conf_t *bcf);
+void ngx_http_guile_breaker_failure (ngx_http_guile_breaker_conf_t *bcf,
+                                     ngx_log_t *log);
+
+#endif /* _NGX_HTTP_GUILE_BREAKER_INCLUDED_ */
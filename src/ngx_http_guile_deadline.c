@@ -0,0 +1,271 @@
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include "ngx_http_guile_deadline.h"
+#include <gc/gc.h>
+#include <signal.h>
+#include <time.h>
+
+/* Timer signal, nginx workers do not use it */
+#define NGX_HTTP_GUILE_DEADLINE_SIGNAL SIGVTALRM
+
+/* Limits of the handler running in the worker. Interrupts are delivered
+   as asyncs, which may run after the handler returned: they escape only
+   while a limit is active and exceeded. */
+typedef struct
+{
+  timer_t timer;
+  uint64_t deadline;
+  size_t alloc_start;
+  size_t max_alloc;
+
+  /* the handler, run under an escape continuation private to the module
+     so that Scheme code cannot catch the interrupt */
+  scm_t_catch_body body;
+  void *body_data;
+  SCM escape;
+
+  /* the directive of the limit exceeded, NULL otherwise */
+  const char *exceeded;
+
+  unsigned initialized : 1;
+  unsigned active : 1;
+  unsigned armed : 1;
+  unsigned alloc_exceeded : 1;
+} ngx_http_guile_deadline_t;
+
+static ngx_http_guile_deadline_t ngx_http_guile_deadline;
+
+static SCM ngx_http_guile_deadline_call_ec;
+static SCM ngx_http_guile_deadline_body_proc;
+static SCM ngx_http_guile_deadline_interrupt_proc;
+
+static void *ngx_http_guile_deadline_init_scm (void *data);
+static void ngx_http_guile_deadline_start (ngx_msec_t timeout,
+                                           size_t max_alloc);
+static void ngx_http_guile_deadline_stop ();
+static SCM ngx_http_guile_deadline_body (SCM escape);
+static SCM ngx_http_guile_deadline_interrupt (SCM signum);
+static void *ngx_http_guile_deadline_after_gc (void *hook_data, void *fn_data,
+                                               void *data);
+static uint64_t ngx_http_guile_deadline_now ();
+
+/* Worker */
+
+ngx_int_t
+ngx_http_guile_deadline_init_process (ngx_cycle_t *cycle)
+{
+  struct sigevent sev;
+
+  ngx_memzero (&sev, sizeof (struct sigevent));
+  sev.sigev_notify = SIGEV_SIGNAL;
+  sev.sigev_signo = NGX_HTTP_GUILE_DEADLINE_SIGNAL;
+
+  if (timer_create (CLOCK_MONOTONIC, &sev, &ngx_http_guile_deadline.timer)
+      == -1)
+    {
+      ngx_log_error (NGX_LOG_ALERT, cycle->log, ngx_errno,
+                     "timer_create() failed");
+      return NGX_ERROR;
+    }
+
+  // guile threads do not survive fork, the handler is installed here
+  scm_with_guile (ngx_http_guile_deadline_init_scm, NULL);
+
+  ngx_http_guile_deadline.initialized = 1;
+
+  return NGX_OK;
+}
+
+static void *
+ngx_http_guile_deadline_init_scm (void *data)
+{
+  ngx_http_guile_deadline.escape = SCM_BOOL_F;
+
+  ngx_http_guile_deadline_call_ec
+      = scm_gc_protect_object (scm_c_public_ref ("ice-9 control", "call/ec"));
+
+  ngx_http_guile_deadline_body_proc = scm_gc_protect_object (
+      scm_c_make_gsubr ("ngx-handler", 1, 0, 0, ngx_http_guile_deadline_body));
+
+  ngx_http_guile_deadline_interrupt_proc = scm_gc_protect_object (
+      scm_c_make_gsubr ("ngx-handler-limit", 0, 1, 0,
+                        ngx_http_guile_deadline_interrupt));
+
+  // the handler runs as an async of this thread, the worker one
+  scm_sigaction_for_thread (scm_from_int (NGX_HTTP_GUILE_DEADLINE_SIGNAL),
+                            ngx_http_guile_deadline_interrupt_proc,
+                            scm_from_int (SA_RESTART),
+                            scm_current_thread ());
+
+  scm_c_hook_add (&scm_after_gc_c_hook, ngx_http_guile_deadline_after_gc,
+                  NULL, 0);
+
+  return NULL;
+}
+
+/* Handler limits */
+
+/* Call body under the limits. When one is exceeded the handler is left at
+   its next safe point, unwinding dynamic-wind handlers, and exceeded is
+   set to the directive of the limit. */
+SCM
+ngx_http_guile_deadline_run (ngx_msec_t timeout, size_t max_alloc,
+                             scm_t_catch_body body, void *body_data,
+                             const char **exceeded)
+{
+  ngx_http_guile_deadline_t *dl = &ngx_http_guile_deadline;
+  SCM result;
+
+  *exceeded = NULL;
+
+  if (!dl->initialized || (timeout == 0 && max_alloc == 0))
+    return body (body_data);
+
+  dl->body = body;
+  dl->body_data = body_data;
+
+  ngx_http_guile_deadline_start (timeout, max_alloc);
+
+  result = scm_call_1 (ngx_http_guile_deadline_call_ec,
+                       ngx_http_guile_deadline_body_proc);
+
+  ngx_http_guile_deadline_stop ();
+
+  *exceeded = dl->exceeded;
+  dl->escape = SCM_BOOL_F;
+
+  return result;
+}
+
+/* Local helpers impl */
+
+static void
+ngx_http_guile_deadline_start (ngx_msec_t timeout, size_t max_alloc)
+{
+  ngx_http_guile_deadline_t *dl = &ngx_http_guile_deadline;
+  struct itimerspec its;
+
+  dl->active = 1;
+  dl->armed = 0;
+  dl->alloc_exceeded = 0;
+  dl->exceeded = NULL;
+  dl->max_alloc = max_alloc;
+
+  if (max_alloc)
+    dl->alloc_start = GC_get_total_bytes ();
+
+  if (timeout == 0)
+    return;
+
+  dl->deadline = ngx_http_guile_deadline_now () + (uint64_t)timeout * 1000000;
+
+  ngx_memzero (&its, sizeof (struct itimerspec));
+  its.it_value.tv_sec = timeout / 1000;
+  its.it_value.tv_nsec = (timeout % 1000) * 1000000;
+
+  if (timer_settime (dl->timer, 0, &its, NULL) == -1)
+    {
+      ngx_log_error (NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                     "timer_settime() failed");
+      return;
+    }
+
+  dl->armed = 1;
+}
+
+static void
+ngx_http_guile_deadline_stop ()
+{
+  ngx_http_guile_deadline_t *dl = &ngx_http_guile_deadline;
+  struct itimerspec its;
+
+  dl->active = 0;
+
+  if (!dl->armed)
+    return;
+
+  dl->armed = 0;
+
+  ngx_memzero (&its, sizeof (struct itimerspec));
+
+  if (timer_settime (dl->timer, 0, &its, NULL) == -1)
+    ngx_log_error (NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                   "timer_settime() failed");
+}
+
+/* Entered by call/ec, escape leaves the handler */
+static SCM
+ngx_http_guile_deadline_body (SCM escape)
+{
+  ngx_http_guile_deadline.escape = escape;
+
+  return ngx_http_guile_deadline.body (ngx_http_guile_deadline.body_data);
+}
+
+/* Async of the timer signal or of a collection */
+static SCM
+ngx_http_guile_deadline_interrupt (SCM signum)
+{
+  ngx_http_guile_deadline_t *dl = &ngx_http_guile_deadline;
+
+  if (!dl->active || dl->exceeded)
+    return SCM_UNSPECIFIED;
+
+  if (dl->alloc_exceeded)
+    dl->exceeded = "guile_handler_max_alloc";
+  else if (dl->armed && ngx_http_guile_deadline_now () >= dl->deadline)
+    dl->exceeded = "guile_handler_timeout";
+  else
+    return SCM_UNSPECIFIED;
+
+  // does not return
+  scm_call_0 (dl->escape);
+
+  return SCM_UNSPECIFIED;
+}
+
+/* Runs as an async after each collection, allocation is only measured
+   there */
+static void *
+ngx_http_guile_deadline_after_gc (void *hook_data, void *fn_data, void *data)
+{
+  ngx_http_guile_deadline_t *dl = &ngx_http_guile_deadline;
+
+  if (!dl->active || dl->max_alloc == 0 || dl->alloc_exceeded)
+    return NULL;
+
+  if (GC_get_total_bytes () - dl->alloc_start > dl->max_alloc)
+    {
+      dl->alloc_exceeded = 1;
+      scm_system_async_mark (ngx_http_guile_deadline_interrupt_proc);
+    }
+
+  return NULL;
+}
+
+static uint64_t
+ngx_http_guile_deadline_now ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,38 @@
+#ifndef _NGX_HTTP_GUILE_DEADLINE_INCLUDED_
+#define _NGX_HTTP_GUILE_DEADLINE_INCLUDED_
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+// ngx must be included first
+#include <libguile.h>
+
+/* Worker */
+
+ngx_int_t ngx_http_guile_deadline_init_process (ngx_cycle_t *cycle);
+
+/* Handler limits, called in guile mode */
+
+SCM ngx_http_guile_deadline_run (ngx_msec_t timeout, size_t max_alloc,
+                                 scm_t_catch_body body, void *body_data,
+                                 const char **exceeded);
+
+#endif /* _NGX_HTTP_GUILE_DEADLINE_INCLUDED_ */
@@ -0,0 +1,313 @@
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include "ngx_http_guile_fields.h"
+#include "ngx_http_guile_request.h"
+#include "ngx_guile_string.h"
+
+typedef enum
+{
+  NGX_HTTP_GUILE_FIELD_REQUEST = 0,
+  NGX_HTTP_GUILE_FIELD_HEADER_IN,
+  NGX_HTTP_GUILE_FIELD_HEADER,
+  NGX_HTTP_GUILE_FIELD_METHOD_SYMBOL,
+  NGX_HTTP_GUILE_FIELD_CONTENT_LENGTH_N
+} ngx_http_guile_field_kind_e;
+
+/* A field resolved once: an ngx_str_t of the request or a headers_in
+   pointer at offset, or a header looked up by its lowercase key and
+   hash */
+typedef struct
+{
+  ngx_http_guile_field_kind_e kind;
+  size_t offset;
+  ngx_str_t lowcase_key;
+  ngx_uint_t hash;
+} ngx_http_guile_field_t;
+
+typedef struct
+{
+  ngx_uint_t nfields;
+  ngx_http_guile_field_t *fields;
+} ngx_http_guile_fields_spec_t;
+
+/* Request fields by symbol */
+typedef struct
+{
+  char *name;
+  size_t offset;
+} ngx_http_guile_request_field_t;
+
+static ngx_http_guile_request_field_t ngx_http_guile_request_fields[] = {
+  { "uri", offsetof (ngx_http_request_t, uri) },
+  { "args", offsetof (ngx_http_request_t, args) },
+  { "exten", offsetof (ngx_http_request_t, exten) },
+  { "unparsed-uri", offsetof (ngx_http_request_t, unparsed_uri) },
+  { "method", offsetof (ngx_http_request_t, method_name) },
+  { "request-line", offsetof (ngx_http_request_t, request_line) },
+  { "http-protocol", offsetof (ngx_http_request_t, http_protocol) },
+};
+
+#define NGX_HTTP_GUILE_REQUEST_FIELDS_N                                       \
+  (sizeof (ngx_http_guile_request_fields)                                    \
+   / sizeof (ngx_http_guile_request_field_t))
+
+/* Interned once at init */
+static SCM
+    ngx_http_guile_request_field_symbols[NGX_HTTP_GUILE_REQUEST_FIELDS_N];
+static SCM ngx_http_guile_method_symbol_sym;
+static SCM ngx_http_guile_content_length_n_sym;
+
+static SCM ngx_http_guile_fields_spec_scm;
+static ngx_flag_t ngx_http_guile_fields_initialized;
+
+/* Local helpers */
+
+static void compile_header (ngx_http_guile_field_t *f, SCM name);
+static SCM field_value (ngx_http_request_t *r, ngx_http_guile_field_t *f);
+static ngx_table_elt_t *find_header (ngx_http_request_t *r,
+                                     ngx_http_guile_field_t *f);
+
+/* Initialization */
+
+void
+ngx_http_guile_init_fields ()
+{
+  ngx_uint_t i;
+
+  // every guile_init_script runs this, scripts may keep compiled specs
+  if (ngx_http_guile_fields_initialized)
+    return;
+
+  ngx_http_guile_fields_initialized = 1;
+
+  ngx_http_guile_fields_spec_scm = scm_make_foreign_object_type (
+      scm_from_utf8_symbol ("ngx-request-fields-spec"),
+      scm_list_1 (scm_from_utf8_symbol ("spec")), NULL);
+
+  for (i = 0; i < NGX_HTTP_GUILE_REQUEST_FIELDS_N; i++)
+    {
+      ngx_http_guile_request_field_symbols[i] = scm_gc_protect_object (
+          scm_from_utf8_symbol (ngx_http_guile_request_fields[i].name));
+    }
+
+  ngx_http_guile_method_symbol_sym
+      = scm_gc_protect_object (scm_from_utf8_symbol ("method-symbol"));
+  ngx_http_guile_content_length_n_sym
+      = scm_gc_protect_object (scm_from_utf8_symbol ("content-length-n"));
+}
+
+/* Request fields */
+
+/* Offset of the ngx_str_t named by symbol in ngx_http_request_t */
+ngx_int_t
+ngx_http_guile_field_offset (SCM symbol, size_t *offset)
+{
+  ngx_uint_t i;
+
+  for (i = 0; i < NGX_HTTP_GUILE_REQUEST_FIELDS_N; i++)
+    {
+      if (scm_is_eq (symbol, ngx_http_guile_request_field_symbols[i]))
+        {
+          *offset = ngx_http_guile_request_fields[i].offset;
+          return NGX_OK;
+        }
+    }
+
+  return NGX_DECLINED;
+}
+
+/* Scheme */
+
+/* Compile a list of fields, request field symbols or header names, for
+   ngx-request-fields. Header names known to nginx resolve to their
+   headers_in field. */
+SCM
+ngx_http_guile_request_fields_spec (SCM fields)
+{
+  ngx_http_guile_fields_spec_t *spec;
+  ngx_http_guile_field_t *f;
+  long n;
+  SCM field;
+
+  n = scm_ilength (fields);
+  SCM_ASSERT (n >= 0, fields, SCM_ARG1, "ngx-request-fields-spec");
+
+  spec = scm_gc_malloc (sizeof (ngx_http_guile_fields_spec_t),
+                        "ngx-request-fields-spec");
+  spec->nfields = n;
+  spec->fields = scm_gc_malloc (n * sizeof (ngx_http_guile_field_t),
+                                "ngx-request-fields-spec");
+
+  for (f = spec->fields; scm_is_pair (fields); fields = scm_cdr (fields), f++)
+    {
+      field = scm_car (fields);
+
+      ngx_memzero (f, sizeof (ngx_http_guile_field_t));
+
+      if (scm_is_string (field))
+        {
+          compile_header (f, field);
+          continue;
+        }
+
+      SCM_ASSERT (scm_is_symbol (field), field, SCM_ARG1,
+                  "ngx-request-fields-spec");
+
+      if (ngx_http_guile_field_offset (field, &f->offset) == NGX_OK)
+        f->kind = NGX_HTTP_GUILE_FIELD_REQUEST;
+
+      else if (scm_is_eq (field, ngx_http_guile_method_symbol_sym))
+        f->kind = NGX_HTTP_GUILE_FIELD_METHOD_SYMBOL;
+
+      else if (scm_is_eq (field, ngx_http_guile_content_length_n_sym))
+        f->kind = NGX_HTTP_GUILE_FIELD_CONTENT_LENGTH_N;
+
+      else
+        scm_misc_error ("ngx-request-fields-spec", "unknown request field ~S",
+                        scm_list_1 (field));
+    }
+
+  return scm_make_foreign_object_1 (ngx_http_guile_fields_spec_scm, spec);
+}
+
+/* Values of the fields of spec, in a new vector or in vector. Missing
+   headers are #f. */
+SCM
+ngx_http_guile_request_fields (SCM http_request, SCM spec, SCM vector)
+{
+  ngx_http_guile_fields_spec_t *fs;
+  ngx_http_request_t *r;
+  ngx_uint_t i;
+
+  r = ngx_http_guile_request_unwrap (http_request);
+
+  scm_assert_foreign_object_type (ngx_http_guile_fields_spec_scm, spec);
+  fs = scm_foreign_object_ref (spec, 0);
+
+  if (SCM_UNBNDP (vector))
+    vector = scm_c_make_vector (fs->nfields, SCM_BOOL_F);
+  else
+    SCM_ASSERT (scm_is_simple_vector (vector)
+                    && SCM_SIMPLE_VECTOR_LENGTH (vector) >= fs->nfields,
+                vector, SCM_ARG3, "ngx-request-fields");
+
+  for (i = 0; i < fs->nfields; i++)
+    SCM_SIMPLE_VECTOR_SET (vector, i, field_value (r, &fs->fields[i]));
+
+  return vector;
+}
+
+/* Local helpers impl */
+
+static void
+compile_header (ngx_http_guile_field_t *f, SCM name)
+{
+  ngx_http_header_t *hh;
+  size_t len;
+  char *s;
+
+  s = scm_to_locale_stringn (name, &len);
+
+  for (hh = ngx_http_headers_in; hh->name.len; hh++)
+    {
+      if (hh->offset && hh->name.len == len
+          && ngx_strncasecmp (hh->name.data, (u_char *)s, len) == 0)
+        {
+          free (s);
+
+          f->kind = NGX_HTTP_GUILE_FIELD_HEADER_IN;
+          f->offset = hh->offset;
+          return;
+        }
+    }
+
+  // lives as long as the spec, which points to it
+  f->lowcase_key.data = scm_gc_malloc_pointerless (len ? len : 1,
+                                                   "ngx-request-fields-spec");
+  f->lowcase_key.len = len;
+  f->hash = ngx_hash_strlow (f->lowcase_key.data, (u_char *)s, len);
+  f->kind = NGX_HTTP_GUILE_FIELD_HEADER;
+
+  free (s);
+}
+
+static SCM
+field_value (ngx_http_request_t *r, ngx_http_guile_field_t *f)
+{
+  ngx_table_elt_t *h;
+
+  switch (f->kind)
+    {
+    case NGX_HTTP_GUILE_FIELD_REQUEST:
+      return scm_from_ngx_string (*(ngx_str_t *)((char *)r + f->offset));
+
+    case NGX_HTTP_GUILE_FIELD_HEADER_IN:
+      h = *(ngx_table_elt_t **)((char *)&r->headers_in + f->offset);
+      break;
+
+    case NGX_HTTP_GUILE_FIELD_HEADER:
+      h = find_header (r, f);
+      break;
+
+    case NGX_HTTP_GUILE_FIELD_METHOD_SYMBOL:
+      return ngx_http_guile_method_symbol (r);
+
+    default: /* NGX_HTTP_GUILE_FIELD_CONTENT_LENGTH_N */
+      // -1 when the request has no Content-Length
+      return r->headers_in.content_length_n < 0
+                 ? SCM_BOOL_F
+                 : scm_from_int64 (r->headers_in.content_length_n);
+    }
+
+  return h ? scm_from_ngx_string (h->value) : SCM_BOOL_F;
+}
+
+/* Headers nginx does not keep in headers_in, compared by hash first */
+static ngx_table_elt_t *
+find_header (ngx_http_request_t *r, ngx_http_guile_field_t *f)
+{
+  ngx_list_part_t *part;
+  ngx_table_elt_t *h;
+  ngx_uint_t i;
+
+  part = &r->headers_in.headers.part;
+  h = part->elts;
+
+  for (i = 0; /* void */; i++)
+    {
+      if (i >= part->nelts)
+        {
+          if (part->next == NULL)
+            break;
+
+          part = part->next;
+          h = part->elts;
+          i = 0;
+        }
+
+      if (h[i].hash == f->hash && h[i].key.len == f->lowcase_key.len
+          && ngx_strncmp (h[i].lowcase_key, f->lowcase_key.data,
+                          f->lowcase_key.len)
+                 == 0)
+        return &h[i];
+    }
+
+  return NULL;
+}
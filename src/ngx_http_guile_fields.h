@@ -0,0 +1,41 @@
+#ifndef _NGX_HTTP_GUILE_FIELDS_INCLUDED_
+#define _NGX_HTTP_GUILE_FIELDS_INCLUDED_
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+// ngx must be included first
+#include <libguile.h>
+
+/* Initialization */
+
+void ngx_http_guile_init_fields ();
+
+/* Request fields */
+
+ngx_int_t ngx_http_guile_field_offset (SCM symbol, size_t *offset);
+
+/* Scheme */
+
+SCM ngx_http_guile_request_fields_spec (SCM fields);
+SCM ngx_http_guile_request_fields (SCM http_request, SCM spec, SCM vector);
+
+#endif /* _NGX_HTTP_GUILE_FIELDS_INCLUDED_ */
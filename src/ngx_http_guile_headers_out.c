@@ -0,0 +1,435 @@
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include "ngx_http_guile_headers_out.h"
+#include "ngx_http_guile_request.h"
+
+typedef enum
+{
+  NGX_HTTP_GUILE_HEADER_CUSTOM = 0,
+  NGX_HTTP_GUILE_HEADER_SINGLE,
+  NGX_HTTP_GUILE_HEADER_MULTI,
+  NGX_HTTP_GUILE_HEADER_CONTENT_TYPE,
+  NGX_HTTP_GUILE_HEADER_CONTENT_LENGTH,
+  NGX_HTTP_GUILE_HEADER_LAST_MODIFIED
+} ngx_http_guile_header_kind_e;
+
+/* Header name with its lowercase key and hash computed once. Well-known
+   names also point to their dedicated headers_out field. */
+typedef struct
+{
+  ngx_str_t key;
+  u_char *lowcase_key;
+  ngx_uint_t hash;
+  ngx_http_guile_header_kind_e kind;
+  size_t offset;
+} ngx_http_guile_header_name_t;
+
+static ngx_http_guile_header_name_t ngx_http_guile_known_headers_out[] = {
+  { ngx_string ("Content-Type"), NULL, 0,
+    NGX_HTTP_GUILE_HEADER_CONTENT_TYPE, 0 },
+  { ngx_string ("Content-Length"), NULL, 0,
+    NGX_HTTP_GUILE_HEADER_CONTENT_LENGTH, 0 },
+  { ngx_string ("Last-Modified"), NULL, 0,
+    NGX_HTTP_GUILE_HEADER_LAST_MODIFIED, 0 },
+  { ngx_string ("Server"), NULL, 0, NGX_HTTP_GUILE_HEADER_SINGLE,
+    offsetof (ngx_http_headers_out_t, server) },
+  { ngx_string ("Date"), NULL, 0, NGX_HTTP_GUILE_HEADER_SINGLE,
+    offsetof (ngx_http_headers_out_t, date) },
+  { ngx_string ("Content-Encoding"), NULL, 0, NGX_HTTP_GUILE_HEADER_SINGLE,
+    offsetof (ngx_http_headers_out_t, content_encoding) },
+  { ngx_string ("Location"), NULL, 0, NGX_HTTP_GUILE_HEADER_SINGLE,
+    offsetof (ngx_http_headers_out_t, location) },
+  { ngx_string ("Refresh"), NULL, 0, NGX_HTTP_GUILE_HEADER_SINGLE,
+    offsetof (ngx_http_headers_out_t, refresh) },
+  { ngx_string ("Content-Range"), NULL, 0, NGX_HTTP_GUILE_HEADER_SINGLE,
+    offsetof (ngx_http_headers_out_t, content_range) },
+  { ngx_string ("Accept-Ranges"), NULL, 0, NGX_HTTP_GUILE_HEADER_SINGLE,
+    offsetof (ngx_http_headers_out_t, accept_ranges) },
+  { ngx_string ("WWW-Authenticate"), NULL, 0, NGX_HTTP_GUILE_HEADER_SINGLE,
+    offsetof (ngx_http_headers_out_t, www_authenticate) },
+  { ngx_string ("Expires"), NULL, 0, NGX_HTTP_GUILE_HEADER_SINGLE,
+    offsetof (ngx_http_headers_out_t, expires) },
+  { ngx_string ("ETag"), NULL, 0, NGX_HTTP_GUILE_HEADER_SINGLE,
+    offsetof (ngx_http_headers_out_t, etag) },
+  { ngx_string ("Cache-Control"), NULL, 0, NGX_HTTP_GUILE_HEADER_MULTI,
+    offsetof (ngx_http_headers_out_t, cache_control) },
+  { ngx_string ("Link"), NULL, 0, NGX_HTTP_GUILE_HEADER_MULTI,
+    offsetof (ngx_http_headers_out_t, link) },
+};
+
+#define NGX_HTTP_GUILE_KNOWN_HEADERS_OUT_N                                    \
+  (sizeof (ngx_http_guile_known_headers_out)                                 \
+   / sizeof (ngx_http_guile_header_name_t))
+
+/* symbol -> ngx_http_guile_header_name_t pointer */
+static SCM ngx_http_guile_headers_out_names;
+static ngx_flag_t ngx_http_guile_headers_out_initialized;
+
+/* Local helpers */
+
+static ngx_http_guile_header_name_t *header_name (ngx_http_request_t *r,
+                                                  SCM name);
+static ngx_http_guile_header_name_t *declare_name (SCM sym, u_char *name,
+                                                   size_t len);
+static void set_header_pair (ngx_http_request_t *r, SCM header);
+static ngx_int_t set_header (ngx_http_request_t *r,
+                             ngx_http_guile_header_name_t *hn, SCM value);
+static ngx_table_elt_t *push_header (ngx_http_request_t *r,
+                                     ngx_http_guile_header_name_t *hn,
+                                     ngx_str_t *value);
+static ngx_int_t scm_to_ngx_pool_string (ngx_pool_t *pool, SCM str,
+                                         ngx_str_t *out);
+
+/* Initialization */
+
+void
+ngx_http_guile_init_headers_out ()
+{
+  ngx_http_guile_header_name_t *hn;
+  ngx_uint_t i;
+  SCM sym;
+
+  // every guile_init_script runs this, names declared by an earlier script
+  // stay declared
+  if (ngx_http_guile_headers_out_initialized)
+    return;
+
+  ngx_http_guile_headers_out_initialized = 1;
+
+  ngx_http_guile_headers_out_names
+      = scm_gc_protect_object (scm_c_make_hash_table (64));
+
+  for (i = 0; i < NGX_HTTP_GUILE_KNOWN_HEADERS_OUT_N; i++)
+    {
+      hn = &ngx_http_guile_known_headers_out[i];
+
+      // static storage, computed once for the process
+      hn->lowcase_key = ngx_alloc (hn->key.len, ngx_cycle->log);
+      if (hn->lowcase_key == NULL)
+        scm_memory_error ("ngx_http_guile_init_headers_out");
+
+      hn->hash = ngx_hash_strlow (hn->lowcase_key, hn->key.data,
+                                  hn->key.len);
+
+      sym = scm_from_utf8_symboln ((char *)hn->lowcase_key, hn->key.len);
+      scm_hashq_set_x (ngx_http_guile_headers_out_names, sym,
+                       scm_from_pointer (hn, NULL));
+    }
+}
+
+/* Mutators */
+
+/* Precompute lowercase keys and hashes of custom header names, given as a
+   list of symbols such as '(X-Request-Id Access-Control-Allow-Origin).
+   Lookups are by the declared symbol and by the lowercase one, the key
+   keeps the declared case. Names already declared are skipped, so that
+   calls at request time do not allocate. */
+SCM
+ngx_http_guile_declare_headers_out (SCM names)
+{
+  ngx_http_guile_header_name_t *hn;
+  char *name;
+  size_t len;
+  SCM sym;
+
+  for (; scm_is_pair (names); names = scm_cdr (names))
+    {
+      sym = scm_car (names);
+      SCM_ASSERT (scm_is_symbol (sym), sym, SCM_ARG1,
+                  "ngx-declare-headers-out!");
+
+      if (scm_is_true (scm_hashq_ref (ngx_http_guile_headers_out_names, sym,
+                                      SCM_BOOL_F)))
+        continue;
+
+      name = scm_to_locale_stringn (scm_symbol_to_string (sym), &len);
+      hn = declare_name (sym, (u_char *)name, len);
+      free (name);
+
+      if (hn == NULL)
+        scm_memory_error ("ngx-declare-headers-out!");
+    }
+
+  return SCM_UNSPECIFIED;
+}
+
+/* Write many headers in one call. headers is an alist or a vector of
+   (name . value) pairs, names are symbols or strings. */
+SCM
+ngx_http_guile_request_set_headers_out_x (SCM http_request, SCM headers)
+{
+  ngx_http_request_t *r;
+  size_t i, n;
+
+  r = ngx_http_guile_request_unwrap (http_request);
+
+  if (scm_is_vector (headers))
+    {
+      n = scm_c_vector_length (headers);
+
+      for (i = 0; i < n; i++)
+        set_header_pair (r, scm_c_vector_ref (headers, i));
+
+      return SCM_UNSPECIFIED;
+    }
+
+  for (; scm_is_pair (headers); headers = scm_cdr (headers))
+    set_header_pair (r, scm_car (headers));
+
+  SCM_ASSERT (scm_is_null (headers), headers, SCM_ARG2,
+              "ngx-request-set-headers-out!");
+
+  return SCM_UNSPECIFIED;
+}
+
+/* Local helpers impl */
+
+static void
+set_header_pair (ngx_http_request_t *r, SCM header)
+{
+  ngx_http_guile_header_name_t *hn;
+
+  SCM_ASSERT (scm_is_pair (header), header, SCM_ARG2,
+              "ngx-request-set-headers-out!");
+
+  hn = header_name (r, scm_car (header));
+  if (hn == NULL || set_header (r, hn, scm_cdr (header)) != NGX_OK)
+    scm_memory_error ("ngx-request-set-headers-out!");
+}
+
+static ngx_http_guile_header_name_t *
+header_name (ngx_http_request_t *r, SCM name)
+{
+  ngx_http_guile_header_name_t *hn;
+  ngx_str_t key;
+  SCM ptr, str;
+
+  // fast path, declared or well-known lowercase symbol
+  if (scm_is_symbol (name))
+    {
+      ptr = scm_hashq_ref (ngx_http_guile_headers_out_names, name,
+                           SCM_BOOL_F);
+      if (scm_is_true (ptr))
+        return scm_to_pointer (ptr);
+
+      str = scm_symbol_to_string (name);
+    }
+  else
+    str = name;
+
+  if (scm_to_ngx_pool_string (r->pool, str, &key) != NGX_OK)
+    return NULL;
+
+  hn = ngx_palloc (r->pool, sizeof (ngx_http_guile_header_name_t));
+  if (hn == NULL)
+    return NULL;
+
+  hn->key = key;
+  hn->lowcase_key = ngx_pnalloc (r->pool, key.len);
+  if (hn->lowcase_key == NULL)
+    return NULL;
+
+  hn->hash = ngx_hash_strlow (hn->lowcase_key, key.data, key.len);
+
+  // names given in other cases may still be well known
+  ptr = scm_hashq_ref (
+      ngx_http_guile_headers_out_names,
+      scm_from_utf8_symboln ((char *)hn->lowcase_key, key.len), SCM_BOOL_F);
+  if (scm_is_true (ptr))
+    return scm_to_pointer (ptr);
+
+  hn->kind = NGX_HTTP_GUILE_HEADER_CUSTOM;
+  hn->offset = 0;
+
+  return hn;
+}
+
+static ngx_http_guile_header_name_t *
+declare_name (SCM sym, u_char *name, size_t len)
+{
+  ngx_http_guile_header_name_t *hn;
+  SCM lowcase, ptr;
+
+  // declarations live as long as the process, like the Scheme symbols
+  hn = ngx_alloc (sizeof (ngx_http_guile_header_name_t) + 2 * len,
+                  ngx_cycle->log);
+  if (hn == NULL)
+    return NULL;
+
+  hn->key.len = len;
+  hn->key.data = (u_char *)(hn + 1);
+  hn->lowcase_key = hn->key.data + len;
+  ngx_memcpy (hn->key.data, name, len);
+
+  hn->hash = ngx_hash_strlow (hn->lowcase_key, name, len);
+  hn->kind = NGX_HTTP_GUILE_HEADER_CUSTOM;
+  hn->offset = 0;
+
+  lowcase = scm_from_utf8_symboln ((char *)hn->lowcase_key, len);
+
+  // well-known fields and names declared in another case are shared
+  ptr = scm_hashq_ref (ngx_http_guile_headers_out_names, lowcase,
+                       SCM_BOOL_F);
+
+  if (scm_is_true (ptr))
+    {
+      ngx_free (hn);
+      hn = scm_to_pointer (ptr);
+    }
+  else
+    {
+      ptr = scm_from_pointer (hn, NULL);
+      scm_hashq_set_x (ngx_http_guile_headers_out_names, lowcase, ptr);
+    }
+
+  scm_hashq_set_x (ngx_http_guile_headers_out_names, sym, ptr);
+
+  return hn;
+}
+
+static ngx_int_t
+set_header (ngx_http_request_t *r, ngx_http_guile_header_name_t *hn,
+            SCM value)
+{
+  ngx_table_elt_t *h, **field, **last;
+  ngx_str_t v;
+
+  if (hn->kind == NGX_HTTP_GUILE_HEADER_CONTENT_LENGTH
+      && scm_is_integer (value))
+    {
+      r->headers_out.content_length_n = scm_to_int64 (value);
+      if (r->headers_out.content_length)
+        {
+          r->headers_out.content_length->hash = 0;
+          r->headers_out.content_length = NULL;
+        }
+
+      return NGX_OK;
+    }
+
+  if (scm_to_ngx_pool_string (r->pool, value, &v) != NGX_OK)
+    return NGX_ERROR;
+
+  switch (hn->kind)
+    {
+    case NGX_HTTP_GUILE_HEADER_CONTENT_TYPE:
+      r->headers_out.content_type = v;
+      r->headers_out.content_type_len = v.len;
+      r->headers_out.content_type_lowcase = NULL;
+      r->headers_out.content_type_hash = 0;
+      return NGX_OK;
+
+    case NGX_HTTP_GUILE_HEADER_CONTENT_LENGTH:
+      r->headers_out.content_length_n = ngx_atoof (v.data, v.len);
+      if (r->headers_out.content_length)
+        {
+          r->headers_out.content_length->hash = 0;
+          r->headers_out.content_length = NULL;
+        }
+
+      return NGX_OK;
+
+    case NGX_HTTP_GUILE_HEADER_LAST_MODIFIED:
+      if (r->headers_out.last_modified)
+        r->headers_out.last_modified->hash = 0;
+
+      h = push_header (r, hn, &v);
+      if (h == NULL)
+        return NGX_ERROR;
+
+      r->headers_out.last_modified = h;
+      r->headers_out.last_modified_time = ngx_parse_http_time (v.data, v.len);
+      return NGX_OK;
+
+    case NGX_HTTP_GUILE_HEADER_SINGLE:
+      field = (ngx_table_elt_t **)((char *)&r->headers_out + hn->offset);
+
+      // single valued, replace what was there
+      if (*field)
+        (*field)->hash = 0;
+
+      *field = push_header (r, hn, &v);
+      return *field ? NGX_OK : NGX_ERROR;
+
+    case NGX_HTTP_GUILE_HEADER_MULTI:
+      h = push_header (r, hn, &v);
+      if (h == NULL)
+        return NGX_ERROR;
+
+      // append to the chain of headers with the same name
+      last = (ngx_table_elt_t **)((char *)&r->headers_out + hn->offset);
+      while (*last)
+        last = &(*last)->next;
+
+      *last = h;
+      return NGX_OK;
+
+    default:
+      return push_header (r, hn, &v) ? NGX_OK : NGX_ERROR;
+    }
+}
+
+static ngx_table_elt_t *
+push_header (ngx_http_request_t *r, ngx_http_guile_header_name_t *hn,
+             ngx_str_t *value)
+{
+  ngx_table_elt_t *h;
+
+  h = ngx_list_push (&r->headers_out.headers);
+  if (h == NULL)
+    return NULL;
+
+  h->hash = hn->hash;
+  h->key = hn->key;
+  h->lowcase_key = hn->lowcase_key;
+  h->value = *value;
+  h->next = NULL;
+
+  return h;
+}
+
+/* Copy a Scheme string in the pool, converting it only once in the common
+   case where the locale encoding takes one byte per character */
+static ngx_int_t
+scm_to_ngx_pool_string (ngx_pool_t *pool, SCM str, ngx_str_t *out)
+{
+  size_t len, n;
+
+  len = scm_c_string_length (str);
+
+  out->data = ngx_pnalloc (pool, len);
+  if (out->data == NULL)
+    return NGX_ERROR;
+
+  n = scm_to_locale_stringbuf (str, (char *)out->data, len);
+
+  if (n > len)
+    {
+      out->data = ngx_pnalloc (pool, n);
+      if (out->data == NULL)
+        return NGX_ERROR;
+
+      scm_to_locale_stringbuf (str, (char *)out->data, n);
+    }
+
+  out->len = n;
+
+  return NGX_OK;
+}
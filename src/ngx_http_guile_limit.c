@@ -0,0 +1,451 @@
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include "ngx_http_guile_limit.h"
+// module declaration
+#include "ngx_http_guile_request.h"
+
+/* Buckets probed for a key before giving up */
+#define NGX_HTTP_GUILE_LIMIT_PROBES 8
+
+/* Workers cache the time, so a bucket may have been updated a little
+   later than now. Larger differences are a bucket idle for so long that
+   its 32 bit time wrapped. */
+#define NGX_HTTP_GUILE_LIMIT_MAX_SKEW 60000
+
+/* Token bucket in shared memory. The key is a 64 bit hash of the Scheme
+   key, 0 for free buckets. The state packs the time of the last update in
+   milliseconds (high 32 bits) and the available tokens in thousandths
+   (low 32 bits), so that it is updated with a single compare-and-swap and
+   workers never wait on each other. A state of 0 is a full bucket. */
+typedef struct
+{
+  ngx_atomic_t key;
+  ngx_atomic_t state;
+} ngx_http_guile_bucket_t;
+
+typedef struct
+{
+  ngx_uint_t nbuckets;
+  ngx_http_guile_bucket_t buckets[1];
+} ngx_http_guile_limit_shctx_t;
+
+typedef struct
+{
+  ngx_http_guile_limit_shctx_t *sh;
+
+  /* thousandths of token per second, and bucket capacity in thousandths */
+  uint64_t rate;
+  uint64_t capacity;
+} ngx_http_guile_limit_ctx_t;
+
+/* Tag of the rate limit zones, distinct from the one of the breaker
+   zones so that nginx rejects a name used by both */
+static ngx_uint_t ngx_http_guile_limit_tag;
+
+static ngx_int_t ngx_http_guile_limit_init_zone (ngx_shm_zone_t *shm_zone,
+                                                 void *data);
+static ngx_http_guile_limit_ctx_t *find_zone (SCM zone);
+static ngx_http_guile_limit_ctx_t *find_shm_zone (u_char *name, size_t len);
+static ngx_http_guile_bucket_t *find_bucket (ngx_http_guile_limit_ctx_t *ctx,
+                                             uint64_t key, uint32_t now);
+static uint64_t refill (ngx_http_guile_limit_ctx_t *ctx, uint64_t state,
+                        uint32_t now);
+static ngx_flag_t take (ngx_http_guile_limit_ctx_t *ctx,
+                        ngx_http_guile_bucket_t *b, uint64_t cost,
+                        uint32_t now);
+
+/* Configuration */
+
+/* guile_rate_limit_zone name:size rate=rate [burst=number] */
+char *
+ngx_http_guile_limit_zone (ngx_conf_t *cf)
+{
+  ngx_http_guile_limit_ctx_t *ctx;
+  ngx_shm_zone_t *shm_zone;
+  ngx_str_t *value, name, s;
+  ngx_int_t rate, scale, burst;
+  ssize_t size;
+  u_char *p;
+  ngx_uint_t i;
+
+#if (NGX_PTR_SIZE < 8)
+  ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                      "\"guile_rate_limit_zone\" requires 64 bit atomic "
+                      "operations");
+  return NGX_CONF_ERROR;
+#endif
+
+  value = cf->args->elts;
+
+  p = (u_char *)ngx_strchr (value[1].data, ':');
+  if (p == NULL || p == value[1].data)
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "invalid zone \"%V\"",
+                          &value[1]);
+      return NGX_CONF_ERROR;
+    }
+
+  name.data = value[1].data;
+  name.len = p - name.data;
+
+  s.data = p + 1;
+  s.len = value[1].data + value[1].len - s.data;
+
+  size = ngx_parse_size (&s);
+  if (size == NGX_ERROR || size < (ssize_t)(8 * ngx_pagesize))
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"",
+                          &value[1]);
+      return NGX_CONF_ERROR;
+    }
+
+  rate = 0;
+  scale = 1;
+  burst = -1;
+
+  for (i = 2; i < cf->args->nelts; i++)
+    {
+      if (ngx_strncmp (value[i].data, "rate=", 5) == 0)
+        {
+          s.data = value[i].data + 5;
+          s.len = value[i].len - 5;
+
+          if (s.len > 3 && ngx_strncmp (s.data + s.len - 3, "r/s", 3) == 0)
+            scale = 1;
+          else if (s.len > 3
+                   && ngx_strncmp (s.data + s.len - 3, "r/m", 3) == 0)
+            scale = 60;
+          else
+            goto invalid;
+
+          rate = ngx_atoi (s.data, s.len - 3);
+          if (rate <= 0)
+            goto invalid;
+
+          continue;
+        }
+
+      if (ngx_strncmp (value[i].data, "burst=", 6) == 0)
+        {
+          burst = ngx_atoi (value[i].data + 6, value[i].len - 6);
+          if (burst <= 0)
+            goto invalid;
+
+          continue;
+        }
+
+    invalid:
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                          &value[i]);
+      return NGX_CONF_ERROR;
+    }
+
+  if (rate == 0)
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                          "no rate is defined for zone \"%V\"", &name);
+      return NGX_CONF_ERROR;
+    }
+
+  ctx = ngx_pcalloc (cf->pool, sizeof (ngx_http_guile_limit_ctx_t));
+  if (ctx == NULL)
+    return NGX_CONF_ERROR;
+
+  ctx->rate = (uint64_t)rate * 1000 / scale;
+
+  // by default allow one second worth of requests at once
+  ctx->capacity
+      = (uint64_t)(burst > 0 ? burst : ngx_max (rate / scale, 1)) * 1000;
+
+  if (ctx->capacity > 0xffffffff)
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "burst is too large");
+      return NGX_CONF_ERROR;
+    }
+
+  shm_zone
+      = ngx_shared_memory_add (cf, &name, size, &ngx_http_guile_limit_tag);
+  if (shm_zone == NULL)
+    return NGX_CONF_ERROR;
+
+  if (shm_zone->data)
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+                          &name);
+      return NGX_CONF_ERROR;
+    }
+
+  shm_zone->init = ngx_http_guile_limit_init_zone;
+  shm_zone->data = ctx;
+
+  return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_guile_limit_init_zone (ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_http_guile_limit_ctx_t *octx = data;
+  ngx_http_guile_limit_ctx_t *ctx;
+  ngx_slab_pool_t *shpool;
+  size_t size;
+
+  ctx = shm_zone->data;
+
+  // reload, buckets survive and only the rate may change
+  if (octx)
+    {
+      ctx->sh = octx->sh;
+      return NGX_OK;
+    }
+
+  shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+  if (shm_zone->shm.exists)
+    {
+      ctx->sh = shpool->data;
+      return NGX_OK;
+    }
+
+  // one table filling the zone, allocated once and never freed
+  size = (shpool->end - shpool->start) - ngx_pagesize;
+
+  ctx->sh = ngx_slab_calloc (shpool, size);
+  if (ctx->sh == NULL)
+    return NGX_ERROR;
+
+  ctx->sh->nbuckets = (size - offsetof (ngx_http_guile_limit_shctx_t, buckets))
+                      / sizeof (ngx_http_guile_bucket_t);
+
+  shpool->data = ctx->sh;
+
+  return NGX_OK;
+}
+
+/* Scheme */
+
+/* (ngx-rate-limit zone key [cost]) takes cost tokens (default 1) from the
+   bucket of key, returning #t when allowed and #f when limited */
+SCM
+ngx_http_guile_rate_limit (SCM zone, SCM key, SCM cost)
+{
+  ngx_http_guile_limit_ctx_t *ctx;
+  ngx_http_guile_bucket_t *b;
+  uint64_t hash, tokens;
+  uint32_t now;
+  char *str;
+  size_t len;
+
+  ctx = find_zone (zone);
+  if (ctx == NULL)
+    scm_misc_error ("ngx-rate-limit", "unknown zone ~S", scm_list_1 (zone));
+
+  tokens = SCM_UNBNDP (cost) ? 1000 : (uint64_t)scm_to_uint32 (cost) * 1000;
+
+  str = scm_to_locale_stringn (key, &len);
+  hash = (uint64_t)ngx_crc32_short ((u_char *)str, len) << 32
+         | ngx_murmur_hash2 ((u_char *)str, len);
+  free (str);
+
+  if (hash == 0)
+    hash = 1;
+
+  now = (uint32_t)ngx_current_msec;
+
+  b = find_bucket (ctx, hash, now);
+
+  // table full around this key, fail open rather than block traffic
+  if (b == NULL)
+    return SCM_BOOL_T;
+
+  return scm_from_bool (take (ctx, b, tokens, now));
+}
+
+/* Local helpers impl */
+
+/* Zones by the name used in Scheme, symbol or string, so that the shared
+   memory list is scanned once per name. A new cycle only happens in the
+   same process without a master, which drops the cache. */
+static ngx_http_guile_limit_ctx_t *
+find_zone (SCM zone)
+{
+  static SCM zones = SCM_BOOL_F;
+  static ngx_cycle_t *cycle;
+  ngx_http_guile_limit_ctx_t *ctx;
+  SCM name, cached;
+  char *str;
+  size_t len;
+
+  if (scm_is_false (zones))
+    zones = scm_gc_protect_object (scm_c_make_hash_table (8));
+
+  if (cycle != ngx_cycle)
+    {
+      scm_hash_clear_x (zones);
+      cycle = (ngx_cycle_t *)ngx_cycle;
+    }
+
+  cached = scm_hash_ref (zones, zone, SCM_BOOL_F);
+  if (scm_is_true (cached))
+    return scm_to_pointer (cached);
+
+  name = scm_is_symbol (zone) ? scm_symbol_to_string (zone) : zone;
+
+  str = scm_to_locale_stringn (name, &len);
+  ctx = find_shm_zone ((u_char *)str, len);
+  free (str);
+
+  if (ctx == NULL)
+    return NULL;
+
+  // a string key is copied, the caller may mutate its own
+  if (scm_is_string (zone))
+    zone = scm_string_copy (zone);
+
+  scm_hash_set_x (zones, zone, scm_from_pointer (ctx, NULL));
+
+  return ctx;
+}
+
+static ngx_http_guile_limit_ctx_t *
+find_shm_zone (u_char *name, size_t len)
+{
+  ngx_list_part_t *part;
+  ngx_shm_zone_t *shm_zone;
+  ngx_uint_t i;
+
+  part = &ngx_cycle->shared_memory.part;
+  shm_zone = part->elts;
+
+  for (i = 0; /* void */; i++)
+    {
+      if (i >= part->nelts)
+        {
+          if (part->next == NULL)
+            return NULL;
+
+          part = part->next;
+          shm_zone = part->elts;
+          i = 0;
+        }
+
+      if (shm_zone[i].tag == &ngx_http_guile_limit_tag
+          && shm_zone[i].shm.name.len == len
+          && ngx_strncmp (shm_zone[i].shm.name.data, name, len) == 0)
+        return shm_zone[i].data;
+    }
+}
+
+/* Open addressing over a few buckets. A bucket owned by another key can be
+   taken over once it is full again, i.e. idle long enough to be
+   forgotten. */
+static ngx_http_guile_bucket_t *
+find_bucket (ngx_http_guile_limit_ctx_t *ctx, uint64_t key, uint32_t now)
+{
+  ngx_http_guile_limit_shctx_t *sh = ctx->sh;
+  ngx_http_guile_bucket_t *b;
+  uint64_t k, state;
+  ngx_uint_t i, slot;
+
+  slot = key % sh->nbuckets;
+
+  for (i = 0; i < NGX_HTTP_GUILE_LIMIT_PROBES; i++)
+    {
+      b = &sh->buckets[(slot + i) % sh->nbuckets];
+      k = b->key;
+
+      if (k == key)
+        return b;
+
+      if (k == 0 && ngx_atomic_cmp_set (&b->key, 0, key))
+        return b;
+
+      // another worker may have claimed it for the same key
+      if (b->key == key)
+        return b;
+    }
+
+  for (i = 0; i < NGX_HTTP_GUILE_LIMIT_PROBES; i++)
+    {
+      b = &sh->buckets[(slot + i) % sh->nbuckets];
+      k = b->key;
+      state = b->state;
+
+      if ((refill (ctx, state, now) & 0xffffffff) == ctx->capacity
+          && ngx_atomic_cmp_set (&b->key, k, key))
+        {
+          ngx_atomic_cmp_set (&b->state, state, 0);
+          return b;
+        }
+    }
+
+  return NULL;
+}
+
+static uint64_t
+refill (ngx_http_guile_limit_ctx_t *ctx, uint64_t state, uint32_t now)
+{
+  uint64_t tokens;
+  int32_t elapsed;
+
+  if (state == 0)
+    return ((uint64_t)now << 32) | ctx->capacity;
+
+  // signed difference survives the wrap of the 32 bit clock
+  elapsed = (int32_t)(now - (uint32_t)(state >> 32));
+
+  // another worker stored a later time, keep it and refill nothing
+  if (elapsed <= 0 && elapsed > -NGX_HTTP_GUILE_LIMIT_MAX_SKEW)
+    return state;
+
+  if (elapsed < 0)
+    return ((uint64_t)now << 32) | ctx->capacity;
+
+  tokens = (state & 0xffffffff) + (uint64_t)elapsed * ctx->rate / 1000;
+
+  if (tokens > ctx->capacity)
+    tokens = ctx->capacity;
+
+  return ((uint64_t)now << 32) | tokens;
+}
+
+static ngx_flag_t
+take (ngx_http_guile_limit_ctx_t *ctx, ngx_http_guile_bucket_t *b,
+      uint64_t cost, uint32_t now)
+{
+  uint64_t old, state;
+
+  for (;;)
+    {
+      old = b->state;
+      state = refill (ctx, old, now);
+
+      if ((state & 0xffffffff) < cost)
+        return 0;
+
+      state -= cost;
+
+      // 0 means full, keep it for fresh buckets only
+      if (state == 0)
+        state = (uint64_t)1 << 32;
+
+      if (ngx_atomic_cmp_set (&b->state, old, state))
+        return 1;
+    }
+}
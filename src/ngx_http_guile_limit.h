@@ -0,0 +1,36 @@
+#ifndef _NGX_HTTP_GUILE_LIMIT_INCLUDED_
+#define _NGX_HTTP_GUILE_LIMIT_INCLUDED_
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+// ngx must be included first
+#include <libguile.h>
+
+/* Configuration */
+
+char *ngx_http_guile_limit_zone (ngx_conf_t *cf);
+
+/* Scheme */
+
+SCM ngx_http_guile_rate_limit (SCM zone, SCM key, SCM cost);
+
+#endif /* _NGX_HTTP_GUILE_LIMIT_INCLUDED_ */
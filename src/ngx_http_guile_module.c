@@ -22,28 +22,114 @@
 #include <ngx_crypt.h>
 #include <ngx_http.h>
 // has to be included after ngx
+#include "ngx_http_guile_body.h"
+#include "ngx_http_guile_breaker.h"
+#include "ngx_http_guile_deadline.h"
+#include "ngx_http_guile_fields.h"
+#include "ngx_http_guile_headers_out.h"
+#include "ngx_http_guile_limit.h"
+#include "ngx_http_guile_regex.h"
 #include "ngx_http_guile_request.h"
+#include "ngx_http_guile_route.h"
+#include "ngx_http_guile_trace.h"
 #include <libguile.h>
 #include <time.h>
 
 #define NGX_HTTP_GUILE_MODULE "ngx http base"
 
+typedef struct
+{
+  ngx_int_t jit_threshold;
+  ngx_str_t warmup;
+  ngx_uint_t warmup_iterations;
+  size_t max_heap;
+  ngx_uint_t max_requests;
+  ngx_http_guile_trace_conf_t *trace;
+  ngx_flag_t deadlines;
+} ngx_http_guile_main_conf_t;
+
 typedef struct
 {
   ngx_http_complex_value_t *init_script;
+  ngx_flag_t ctx_inherit;
+  ngx_http_guile_routes_t *routes;
+  ngx_uint_t error_status;
+  ngx_http_guile_breaker_conf_t *breaker;
+  ngx_flag_t read_body;
+  ngx_msec_t handler_timeout;
+  size_t handler_max_alloc;
+  ngx_uint_t handler_limit_status;
 } ngx_http_guile_loc_conf_t;
 
+/* A request handled by Scheme, the route is matched before entering
+   Guile */
+typedef struct
+{
+  ngx_http_request_t *request;
+  ngx_http_guile_route_match_t *route;
+  ngx_flag_t failed;
+  ngx_flag_t limited;
+  /* the "scheme" span is open, closed on errors too */
+  ngx_flag_t in_scheme;
+} ngx_http_guile_call_t;
+
 static ngx_int_t ngx_http_guile_handler (ngx_http_request_t *r);
+static ngx_int_t ngx_http_guile_subrequest_handler (ngx_http_request_t *r);
+static void *ngx_http_guile_create_main_conf (ngx_conf_t *cf);
+static char *ngx_http_guile_init_main_conf (ngx_conf_t *cf, void *conf);
 static void *ngx_http_guile_create_loc_conf (ngx_conf_t *cf);
 static char *ngx_http_guile_merge_loc_conf (ngx_conf_t *cf, void *parent,
                                             void *child);
 static ngx_int_t ngx_http_guile_init (ngx_conf_t *cf);
 static char *ngx_http_guile_init_script (ngx_conf_t *cf, ngx_command_t *cmd,
                                          void *conf);
+static char *ngx_http_guile_route (ngx_conf_t *cf, ngx_command_t *cmd,
+                                   void *conf);
+static char *ngx_http_guile_circuit_breaker (ngx_conf_t *cf,
+                                             ngx_command_t *cmd, void *conf);
+static char *ngx_http_guile_rate_limit_zone (ngx_conf_t *cf,
+                                             ngx_command_t *cmd, void *conf);
+static char *ngx_http_guile_jit_threshold (ngx_conf_t *cf,
+                                           ngx_command_t *cmd, void *conf);
+static char *ngx_http_guile_warmup (ngx_conf_t *cf, ngx_command_t *cmd,
+                                    void *conf);
+static char *ngx_http_guile_flight_recorder (ngx_conf_t *cf,
+                                             ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_guile_init_process (ngx_cycle_t *cycle);
+static void ngx_http_guile_exit_process (ngx_cycle_t *cycle);
+static void *ngx_http_guile_after_gc (void *hook_data, void *fn_data,
+                                      void *data);
+static void *ngx_http_guile_log_stats (void *data);
+static uint64_t ngx_http_guile_stat (SCM stats, const char *name);
+static void ngx_http_guile_recycle (ngx_log_t *log, const char *reason);
+static void *ngx_http_guile_warmup_scm (void *data);
+static SCM ngx_http_guile_warmup_body (void *data);
+static SCM ngx_http_guile_warmup_error (void *data, SCM key, SCM args);
+static ngx_http_request_t *ngx_http_guile_warmup_request (ngx_cycle_t *cycle,
+                                                         ngx_pool_t *pool);
 static void *ngx_http_guile_init_scm (void *data);
 static void ngx_http_guile_init_module (void *data);
 static void *ngx_http_guile_handle_request (void *data);
 static SCM ngx_http_guile_handle_request_in_module (void *data);
+static SCM ngx_http_guile_handle_request_catch (void *data);
+static SCM ngx_http_guile_handle_request_body (void *data);
+static SCM ngx_http_guile_handle_request_error (void *data, SCM key,
+                                                SCM args);
+static char *ngx_http_guile_error_message (SCM key, SCM args);
+
+/* Guile is initialized once in the master by the first guile_init_script */
+static ngx_flag_t ngx_http_guile_initialized;
+
+/* Worker state for guile_max_heap and guile_max_requests */
+static size_t ngx_http_guile_max_heap;
+static ngx_uint_t ngx_http_guile_requests;
+
+typedef struct
+{
+  ngx_cycle_t *cycle;
+  SCM proc;
+  SCM request;
+} ngx_http_guile_warmup_t;
 
 static ngx_command_t ngx_http_guile_commands[] = {
 
@@ -53,6 +139,76 @@ static ngx_command_t ngx_http_guile_commands[] = {
     ngx_http_guile_init_script, NGX_HTTP_LOC_CONF_OFFSET,
     offsetof (ngx_http_guile_loc_conf_t, init_script), NULL },
 
+  { ngx_string ("guile_ctx_inherit"),
+    NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+        | NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof (ngx_http_guile_loc_conf_t, ctx_inherit), NULL },
+
+  { ngx_string ("guile_route"),
+    NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+        | NGX_CONF_TAKE3,
+    ngx_http_guile_route, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+  { ngx_string ("guile_error_status"),
+    NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+        | NGX_CONF_TAKE1,
+    ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof (ngx_http_guile_loc_conf_t, error_status), NULL },
+
+  { ngx_string ("guile_circuit_breaker"),
+    NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+        | NGX_CONF_1MORE,
+    ngx_http_guile_circuit_breaker, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+  { ngx_string ("guile_read_body"),
+    NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+        | NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof (ngx_http_guile_loc_conf_t, read_body), NULL },
+
+  { ngx_string ("guile_handler_timeout"),
+    NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+        | NGX_CONF_TAKE1,
+    ngx_conf_set_msec_slot, NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof (ngx_http_guile_loc_conf_t, handler_timeout), NULL },
+
+  { ngx_string ("guile_handler_max_alloc"),
+    NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+        | NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot, NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof (ngx_http_guile_loc_conf_t, handler_max_alloc), NULL },
+
+  { ngx_string ("guile_handler_limit_status"),
+    NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+        | NGX_CONF_TAKE1,
+    ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof (ngx_http_guile_loc_conf_t, handler_limit_status), NULL },
+
+  { ngx_string ("guile_rate_limit_zone"), NGX_HTTP_MAIN_CONF | NGX_CONF_2MORE,
+    ngx_http_guile_rate_limit_zone, 0, 0, NULL },
+
+  { ngx_string ("guile_jit_threshold"), NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+    ngx_http_guile_jit_threshold, NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof (ngx_http_guile_main_conf_t, jit_threshold), NULL },
+
+  { ngx_string ("guile_warmup"), NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+    ngx_http_guile_warmup, NGX_HTTP_MAIN_CONF_OFFSET, 0, NULL },
+
+  { ngx_string ("guile_max_heap"), NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot, NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof (ngx_http_guile_main_conf_t, max_heap), NULL },
+
+  { ngx_string ("guile_max_requests"), NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+    ngx_conf_set_num_slot, NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof (ngx_http_guile_main_conf_t, max_requests), NULL },
+
+  { ngx_string ("guile_trace"), NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+    ngx_http_guile_flight_recorder, NGX_HTTP_MAIN_CONF_OFFSET, 0, NULL },
+
+  { ngx_string ("guile_trace_dump"), NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+    ngx_http_guile_trace_dump, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
   ngx_null_command
 };
 
@@ -60,8 +216,8 @@ static ngx_http_module_t ngx_http_guile_module_ctx = {
   NULL,                /* preconfiguration */
   ngx_http_guile_init, /* postconfiguration */
 
-  NULL, /* create main configuration */
-  NULL, /* init main configuration */
+  ngx_http_guile_create_main_conf, /* create main configuration */
+  ngx_http_guile_init_main_conf,   /* init main configuration */
 
   NULL, /* create server configuration */
   NULL, /* merge server configuration */
@@ -77,10 +233,10 @@ ngx_module_t ngx_http_guile_module
         NGX_HTTP_MODULE,            /* module type */
         NULL,                       /* init master */
         NULL,                       /* init module */
-        NULL,                       /* init process */
+        ngx_http_guile_init_process, /* init process */
         NULL,                       /* init thread */
         NULL,                       /* exit thread */
-        NULL,                       /* exit process */
+        ngx_http_guile_exit_process, /* exit process */
         NULL,                       /* exit master */
         NGX_MODULE_V1_PADDING };
 
@@ -94,30 +250,238 @@ ngx_http_guile_handle_request (void *data)
   return NULL;
 }
 
+/* Handler limits interrupt the handler out of any Scheme catch, they are
+   mapped to guile_handler_limit_status */
 static SCM
 ngx_http_guile_handle_request_in_module (void *data)
 {
-  ngx_http_request_t *http_request = data;
+  ngx_http_guile_call_t *call = data;
+  ngx_http_guile_loc_conf_t *glcf;
+  const char *exceeded;
+  SCM result;
+
+  glcf = ngx_http_get_module_loc_conf (call->request, ngx_http_guile_module);
+
+  result = ngx_http_guile_deadline_run (
+      glcf->handler_timeout, glcf->handler_max_alloc,
+      ngx_http_guile_handle_request_catch, data, &exceeded);
 
-  // TODO unique request name
-  SCM http_request_scm
-      = ngx_http_guile_request_c_make ("my-req", http_request);
+  if (exceeded)
+    {
+      if (call->in_scheme)
+        ngx_http_guile_trace (NGX_HTTP_GUILE_TRACE_END, "scheme");
+
+      ngx_log_error (NGX_LOG_ERR, call->request->connection->log, 0,
+                     "guile handler interrupted, %s exceeded", exceeded);
+
+      call->failed = 1;
+      call->limited = 1;
+    }
+
+  return result;
+}
+
+/* Scheme errors are contained here: they are logged and mapped to
+   guile_error_status instead of unwinding out of scm_with_guile */
+static SCM
+ngx_http_guile_handle_request_catch (void *data)
+{
+  return scm_c_catch (SCM_BOOL_T, ngx_http_guile_handle_request_body, data,
+                      ngx_http_guile_handle_request_error, data, NULL, NULL);
+}
+
+static SCM
+ngx_http_guile_handle_request_error (void *data, SCM key, SCM args)
+{
+  ngx_http_guile_call_t *call = data;
+  char *msg;
+
+  if (call->in_scheme)
+    ngx_http_guile_trace (NGX_HTTP_GUILE_TRACE_END, "scheme");
+
+  msg = ngx_http_guile_error_message (key, args);
+
+  ngx_log_error (NGX_LOG_ERR, call->request->connection->log, 0,
+                 "guile handler error: %s", msg);
+
+  free (msg);
+
+  call->failed = 1;
+
+  return SCM_BOOL_F;
+}
+
+static char *
+ngx_http_guile_error_message (SCM key, SCM args)
+{
+  return scm_to_locale_string (
+      scm_object_to_string (scm_cons (key, args), SCM_UNDEFINED));
+}
+
+static SCM
+ngx_http_guile_handle_request_body (void *data)
+{
+  ngx_http_guile_call_t *call = data;
+  ngx_http_request_t *http_request = call->request;
+  ngx_http_guile_loc_conf_t *glcf;
+  ngx_http_guile_ctx_t *ctx;
+  SCM request, proc;
+
+  glcf = ngx_http_get_module_loc_conf (http_request, ngx_http_guile_module);
+
+  ctx = ngx_http_guile_get_ctx (http_request);
+  if (ctx == NULL)
+    scm_memory_error ("ngx_http_guile_get_ctx");
+
+  request = ngx_http_guile_ctx_request (http_request, ctx, glcf->ctx_inherit);
+
+  if (call->route)
+    {
+      proc = ngx_http_guile_route_proc (call->route->handler,
+                                        scm_current_module ());
+
+      ngx_http_guile_trace (NGX_HTTP_GUILE_TRACE_BEGIN, "scheme");
+      call->in_scheme = 1;
+
+      scm_call_2 (proc, request, ngx_http_guile_route_params (call->route));
+
+      call->in_scheme = 0;
+      ngx_http_guile_trace (NGX_HTTP_GUILE_TRACE_END, "scheme");
+
+      return request;
+    }
 
   SCM parse_request_fun = scm_c_lookup ("ngx-handle-request");
 
-  scm_call_1 (scm_variable_ref (parse_request_fun), http_request_scm);
+  ngx_http_guile_trace (NGX_HTTP_GUILE_TRACE_BEGIN, "scheme");
+  call->in_scheme = 1;
+
+  scm_call_1 (scm_variable_ref (parse_request_fun), request);
+
+  call->in_scheme = 0;
+  ngx_http_guile_trace (NGX_HTTP_GUILE_TRACE_END, "scheme");
 
-  return http_request_scm;
+  return request;
 }
 
 static ngx_int_t
 ngx_http_guile_handler (ngx_http_request_t *r)
 {
-  scm_with_guile (&ngx_http_guile_handle_request, r);
+  ngx_http_guile_main_conf_t *gmcf;
+  ngx_http_guile_loc_conf_t *glcf;
+  ngx_http_guile_route_match_t match;
+  ngx_http_guile_call_t call;
+  ngx_int_t rc;
+
+  glcf = ngx_http_get_module_loc_conf (r, ngx_http_guile_module);
+
+  // fail fast without entering guile while the breaker is open
+  if (glcf->breaker && ngx_http_guile_breaker_open (glcf->breaker))
+    return glcf->breaker->status;
+
+  if (glcf->read_body)
+    {
+      rc = ngx_http_guile_read_body (r);
+      if (rc != NGX_OK)
+        return rc;
+    }
+
+  call.request = r;
+  call.route = NULL;
+  call.failed = 0;
+  call.limited = 0;
+  call.in_scheme = 0;
+
+  if (glcf->routes
+      && ngx_http_guile_route_find (glcf->routes, r, &match) == NGX_OK)
+    call.route = &match;
+
+  ngx_http_guile_trace_request_begin ();
+
+  scm_with_guile (&ngx_http_guile_handle_request, &call);
+
+  ngx_http_guile_trace_request_end ();
+
+  gmcf = ngx_http_get_module_main_conf (r, ngx_http_guile_module);
+
+  // counted without a limit too, for the statistics logged at exit
+  ngx_http_guile_requests++;
+
+  if (gmcf->max_requests && ngx_http_guile_requests == gmcf->max_requests)
+    ngx_http_guile_recycle (r->connection->log, "guile_max_requests reached");
+
+  if (call.failed)
+    {
+      if (glcf->breaker)
+        ngx_http_guile_breaker_failure (glcf->breaker, r->connection->log);
+
+      if (call.limited && glcf->handler_limit_status != NGX_CONF_UNSET_UINT)
+        return glcf->handler_limit_status;
+
+      return glcf->error_status;
+    }
 
   return NGX_OK;
 }
 
+/* nginx skips the access phase for subrequests, those of locations with
+   guile_ctx_inherit run Scheme before the content phase instead */
+static ngx_int_t
+ngx_http_guile_subrequest_handler (ngx_http_request_t *r)
+{
+  ngx_http_guile_loc_conf_t *glcf;
+  ngx_int_t rc;
+
+  if (r == r->main)
+    return NGX_DECLINED;
+
+  glcf = ngx_http_get_module_loc_conf (r, ngx_http_guile_module);
+  if (!glcf->ctx_inherit)
+    return NGX_DECLINED;
+
+  rc = ngx_http_guile_handler (r);
+
+  // let the other precontent handlers run
+  return rc == NGX_OK ? NGX_DECLINED : rc;
+}
+
+static void *
+ngx_http_guile_create_main_conf (ngx_conf_t *cf)
+{
+  ngx_http_guile_main_conf_t *conf;
+
+  conf = ngx_pcalloc (cf->pool, sizeof (ngx_http_guile_main_conf_t));
+  if (conf == NULL)
+    return NULL;
+
+  /*
+   * set by ngx_pcalloc():
+   *
+   *     conf->warmup = { 0, NULL };
+   *     conf->warmup_iterations = 0;
+   *     conf->deadlines = 0;
+   */
+
+  conf->jit_threshold = NGX_CONF_UNSET;
+  conf->max_heap = NGX_CONF_UNSET_SIZE;
+  conf->max_requests = NGX_CONF_UNSET_UINT;
+  conf->trace = NGX_CONF_UNSET_PTR;
+
+  return conf;
+}
+
+static char *
+ngx_http_guile_init_main_conf (ngx_conf_t *cf, void *conf)
+{
+  ngx_http_guile_main_conf_t *gmcf = conf;
+
+  ngx_conf_init_size_value (gmcf->max_heap, 0);
+  ngx_conf_init_uint_value (gmcf->max_requests, 0);
+  ngx_conf_init_ptr_value (gmcf->trace, NULL);
+
+  return NGX_CONF_OK;
+}
+
 static void *
 ngx_http_guile_create_loc_conf (ngx_conf_t *cf)
 {
@@ -128,6 +492,14 @@ ngx_http_guile_create_loc_conf (ngx_conf_t *cf)
     return NULL;
 
   conf->init_script = NGX_CONF_UNSET_PTR;
+  conf->ctx_inherit = NGX_CONF_UNSET;
+  conf->routes = NGX_CONF_UNSET_PTR;
+  conf->error_status = NGX_CONF_UNSET_UINT;
+  conf->breaker = NGX_CONF_UNSET_PTR;
+  conf->read_body = NGX_CONF_UNSET;
+  conf->handler_timeout = NGX_CONF_UNSET_MSEC;
+  conf->handler_max_alloc = NGX_CONF_UNSET_SIZE;
+  conf->handler_limit_status = NGX_CONF_UNSET_UINT;
 
   return conf;
 }
@@ -137,8 +509,47 @@ ngx_http_guile_merge_loc_conf (ngx_conf_t *cf, void *parent, void *child)
 {
   ngx_http_guile_loc_conf_t *prev = parent;
   ngx_http_guile_loc_conf_t *conf = child;
+  ngx_http_guile_main_conf_t *gmcf;
 
   ngx_conf_merge_ptr_value (conf->init_script, prev->init_script, NULL);
+  ngx_conf_merge_value (conf->ctx_inherit, prev->ctx_inherit, 0);
+  // a block declaring routes replaces the inherited table, see README
+  ngx_conf_merge_ptr_value (conf->routes, prev->routes, NULL);
+  ngx_conf_merge_uint_value (conf->error_status, prev->error_status,
+                             NGX_HTTP_INTERNAL_SERVER_ERROR);
+  ngx_conf_merge_ptr_value (conf->breaker, prev->breaker, NULL);
+  ngx_conf_merge_value (conf->read_body, prev->read_body, 0);
+  ngx_conf_merge_msec_value (conf->handler_timeout, prev->handler_timeout, 0);
+  ngx_conf_merge_size_value (conf->handler_max_alloc, prev->handler_max_alloc,
+                             0);
+  // unset falls back to guile_error_status of the same location
+  ngx_conf_merge_uint_value (conf->handler_limit_status,
+                             prev->handler_limit_status, NGX_CONF_UNSET_UINT);
+
+  if (conf->error_status < 400 || conf->error_status > 599)
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                          "\"guile_error_status\" must be between 400 and "
+                          "599");
+      return NGX_CONF_ERROR;
+    }
+
+  if (conf->handler_limit_status != NGX_CONF_UNSET_UINT
+      && (conf->handler_limit_status < 400
+          || conf->handler_limit_status > 599))
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                          "\"guile_handler_limit_status\" must be between "
+                          "400 and 599");
+      return NGX_CONF_ERROR;
+    }
+
+  // the worker arms the limits only when some location uses them
+  if (conf->handler_timeout || conf->handler_max_alloc)
+    {
+      gmcf = ngx_http_conf_get_module_main_conf (cf, ngx_http_guile_module);
+      gmcf->deadlines = 1;
+    }
 
   return NGX_CONF_OK;
 }
@@ -161,6 +572,11 @@ ngx_http_guile_init_module (void *data)
 
   // initialize data types
   ngx_http_guile_init_req_foreign_type ();
+  ngx_http_guile_init_headers_out ();
+  ngx_http_guile_init_fields ();
+#if (NGX_PCRE)
+  ngx_http_guile_init_regex ();
+#endif
 
   // register functions
   // TODO other
@@ -172,6 +588,8 @@ ngx_http_guile_init_module (void *data)
                       ngx_http_guile_request_request_line);
   scm_c_define_gsubr ("ngx-request-method", 1, 0, 0,
                       ngx_http_guile_request_method);
+  scm_c_define_gsubr ("ngx-request-method-symbol", 1, 0, 0,
+                      ngx_http_guile_request_method_symbol);
   scm_c_define_gsubr ("ngx-request-uri", 1, 0, 0, ngx_http_guile_request_uri);
   scm_c_define_gsubr ("ngx-request-args", 1, 0, 0,
                       ngx_http_guile_request_args);
@@ -261,6 +679,57 @@ ngx_http_guile_init_module (void *data)
   scm_c_define_gsubr ("ngx-request-header-cookie", 1, 0, 0,
                       ngx_http_guile_request_header_cookie);
 
+  scm_c_define_gsubr ("ngx-request-arg", 2, 0, 0,
+                      ngx_http_guile_request_arg);
+  scm_c_define_gsubr ("ngx-request-cookie", 2, 0, 0,
+                      ngx_http_guile_request_cookie);
+
+  scm_c_define_gsubr ("ngx-request-content-length-n", 1, 0, 0,
+                      ngx_http_guile_request_content_length_n);
+  scm_c_define_gsubr ("ngx-request-keep-alive-n", 1, 0, 0,
+                      ngx_http_guile_request_keep_alive_n);
+
+  scm_c_define_gsubr ("ngx-request-ctx-ref", 2, 1, 0,
+                      ngx_http_guile_request_ctx_ref);
+  scm_c_define_gsubr ("ngx-request-ctx-set!", 3, 0, 0,
+                      ngx_http_guile_request_ctx_set_x);
+  scm_c_define_gsubr ("ngx-request-ctx-delete!", 2, 0, 0,
+                      ngx_http_guile_request_ctx_delete_x);
+
+  scm_c_define_gsubr ("ngx-request-fields-spec", 1, 0, 0,
+                      ngx_http_guile_request_fields_spec);
+  scm_c_define_gsubr ("ngx-request-fields", 2, 1, 0,
+                      ngx_http_guile_request_fields);
+
+  scm_c_define_gsubr ("ngx-request-form-fields", 1, 0, 0,
+                      ngx_http_guile_request_form_fields);
+  scm_c_define_gsubr ("ngx-request-form-ref", 2, 0, 0,
+                      ngx_http_guile_request_form_ref);
+  scm_c_define_gsubr ("ngx-request-form-file", 2, 0, 0,
+                      ngx_http_guile_request_form_file);
+
+#if (NGX_PCRE)
+  scm_c_define_gsubr ("ngx-regex", 1, 0, 0, ngx_http_guile_regex);
+  scm_c_define_gsubr ("ngx-regex-match", 2, 0, 0,
+                      ngx_http_guile_regex_match);
+  scm_c_define_gsubr ("ngx-request-regex-match", 3, 0, 0,
+                      ngx_http_guile_request_regex_match);
+  scm_c_define_gsubr ("ngx-request-regex-offsets", 3, 0, 0,
+                      ngx_http_guile_request_regex_offsets);
+#endif
+
+  scm_c_define_gsubr ("ngx-trace-begin", 1, 0, 0, ngx_http_guile_trace_begin);
+  scm_c_define_gsubr ("ngx-trace-end", 1, 0, 0, ngx_http_guile_trace_end);
+
+  scm_c_define_gsubr ("ngx-route!", 3, 0, 0, ngx_http_guile_route_define);
+
+  scm_c_define_gsubr ("ngx-rate-limit", 2, 1, 0, ngx_http_guile_rate_limit);
+
+  scm_c_define_gsubr ("ngx-declare-headers-out!", 1, 0, 0,
+                      ngx_http_guile_declare_headers_out);
+  scm_c_define_gsubr ("ngx-request-set-headers-out!", 2, 0, 0,
+                      ngx_http_guile_request_set_headers_out_x);
+
   scm_c_define_gsubr ("ngx-request-user", 1, 0, 0,
                       ngx_http_guile_request_user);
   scm_c_define_gsubr ("ngx-request-passwd", 1, 0, 0,
@@ -269,7 +738,8 @@ ngx_http_guile_init_module (void *data)
   // export functions in current module
   scm_c_export (
       "ngx-request-http-version", "ngx-request-http-protocol",
-      "ngx-request-request-line", "ngx-request-method", "ngx-request-uri",
+      "ngx-request-request-line", "ngx-request-method",
+      "ngx-request-method-symbol", "ngx-request-uri",
       "ngx-request-args", "ngx-request-exten", "ngx-request-unparsed-uri",
       "ngx-request-header-in", "ngx-request-header-host",
       "ngx-request-header-connection", "ngx-request-header-if-modified-since",
@@ -297,8 +767,19 @@ ngx_http_guile_init_module (void *data)
       "ngx-request-header-depth", "ngx-request-header-destination",
       "ngx-request-header-overwrite", "ngx-request-header-date",
 #endif
-      "ngx-request-header-cookie", "ngx-request-user", "ngx-request-passwd",
-      NULL);
+      "ngx-request-header-cookie", "ngx-request-arg", "ngx-request-cookie",
+      "ngx-request-content-length-n", "ngx-request-keep-alive-n",
+      "ngx-request-ctx-ref", "ngx-request-ctx-set!", "ngx-request-ctx-delete!",
+      "ngx-request-fields-spec", "ngx-request-fields",
+      "ngx-request-form-fields", "ngx-request-form-ref",
+      "ngx-request-form-file",
+#if (NGX_PCRE)
+      "ngx-regex", "ngx-regex-match", "ngx-request-regex-match",
+      "ngx-request-regex-offsets",
+#endif
+      "ngx-trace-begin", "ngx-trace-end", "ngx-route!", "ngx-rate-limit",
+      "ngx-declare-headers-out!", "ngx-request-set-headers-out!",
+      "ngx-request-user", "ngx-request-passwd", NULL);
 
   // load the script
   scm_primitive_load (scm_from_locale_stringn ((char *)script_filename->data,
@@ -320,6 +801,12 @@ ngx_http_guile_init (ngx_conf_t *cf)
 
   *h = ngx_http_guile_handler;
 
+  h = ngx_array_push (&cmcf->phases[NGX_HTTP_PRECONTENT_PHASE].handlers);
+  if (h == NULL)
+    return NGX_ERROR;
+
+  *h = ngx_http_guile_subrequest_handler;
+
   return NGX_OK;
 }
 
@@ -352,8 +839,429 @@ ngx_http_guile_init_script (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
   if (ngx_http_compile_complex_value (&ccv) != NGX_OK)
     return NGX_CONF_ERROR;
 
-  // init guile
+  if (glcf->routes == NGX_CONF_UNSET_PTR)
+    {
+      glcf->routes = ngx_http_guile_routes_create (cf->pool);
+      if (glcf->routes == NULL)
+        return NGX_CONF_ERROR;
+    }
+
+  // init guile, ngx-route! declares routes of this block
+  ngx_http_guile_route_set_current (glcf->routes);
   scm_with_guile (ngx_http_guile_init_scm, ccv.value);
+  ngx_http_guile_route_set_current (NULL);
+  ngx_http_guile_initialized = 1;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_guile_route (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_guile_loc_conf_t *glcf = conf;
+  ngx_http_guile_route_handler_t *h;
+  ngx_str_t *value;
+  ngx_uint_t methods;
+  char *err;
+
+  value = cf->args->elts;
+
+  if (value[1].len == 1 && value[1].data[0] == '*')
+    methods = 0;
+  else
+    methods = ngx_http_guile_method_from_name (value[1].data, value[1].len);
+
+  if (methods == NGX_HTTP_UNKNOWN)
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "unknown method \"%V\"",
+                          &value[1]);
+      return NGX_CONF_ERROR;
+    }
+
+  if (glcf->routes == NGX_CONF_UNSET_PTR)
+    {
+      glcf->routes = ngx_http_guile_routes_create (cf->pool);
+      if (glcf->routes == NULL)
+        return NGX_CONF_ERROR;
+    }
+
+  h = ngx_http_guile_route_add (glcf->routes, methods, &value[2], &err);
+  if (h == NULL)
+    return err;
+
+  // zero terminated, it is interned as a symbol
+  h->name.len = value[3].len;
+  h->name.data = ngx_pnalloc (cf->pool, value[3].len + 1);
+  if (h->name.data == NULL)
+    return NGX_CONF_ERROR;
+
+  *ngx_cpymem (h->name.data, value[3].data, value[3].len) = '\0';
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_guile_circuit_breaker (ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf)
+{
+  ngx_http_guile_loc_conf_t *glcf = conf;
+
+  return ngx_http_guile_breaker_conf (cf, &glcf->breaker);
+}
+
+static char *
+ngx_http_guile_rate_limit_zone (ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf)
+{
+  return ngx_http_guile_limit_zone (cf);
+}
+
+/* The JIT threshold is read by libguile from the environment only when it
+   boots, so it has to be set before the first guile_init_script. Workers
+   inherit it from the master. */
+static char *
+ngx_http_guile_jit_threshold (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_guile_main_conf_t *gmcf = conf;
+  ngx_str_t *value;
+  u_char buf[NGX_INT_T_LEN + 1];
+  char *env;
+
+  if (gmcf->jit_threshold != NGX_CONF_UNSET)
+    return "is duplicate";
+
+  value = cf->args->elts;
+
+  gmcf->jit_threshold = ngx_atoi (value[1].data, value[1].len);
+  if (gmcf->jit_threshold == NGX_ERROR)
+    return "invalid value";
+
+  *ngx_sprintf (buf, "%i", gmcf->jit_threshold) = '\0';
+
+  // guile reads the variable once, when the first guile_init_script of the
+  // http or stream block boots it
+  if (scm_initialized_p)
+    {
+      env = getenv ("GUILE_JIT_THRESHOLD");
+
+      // reload with an unchanged value
+      if (env && ngx_strcmp (env, buf) == 0)
+        return NGX_CONF_OK;
+
+      if (ngx_is_init_cycle (cf->cycle->old_cycle))
+        {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "\"%V\" must precede every "
+                              "\"guile_init_script\"",
+                              &cmd->name);
+          return NGX_CONF_ERROR;
+        }
+
+      ngx_conf_log_error (NGX_LOG_WARN, cf, 0,
+                          "\"%V\" changes take effect only on restart",
+                          &cmd->name);
+      return NGX_CONF_OK;
+    }
+
+  if (setenv ("GUILE_JIT_THRESHOLD", (char *)buf, 1) != 0)
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, ngx_errno,
+                          "setenv(\"GUILE_JIT_THRESHOLD\") failed");
+      return NGX_CONF_ERROR;
+    }
 
   return NGX_CONF_OK;
 }
+
+static char *
+ngx_http_guile_warmup (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_guile_main_conf_t *gmcf = conf;
+  ngx_str_t *value;
+  ngx_int_t n;
+
+  if (gmcf->warmup.data != NULL)
+    return "is duplicate";
+
+  value = cf->args->elts;
+
+  n = ngx_atoi (value[2].data, value[2].len);
+  if (n == NGX_ERROR || n == 0)
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                          "invalid number of iterations \"%V\"", &value[2]);
+      return NGX_CONF_ERROR;
+    }
+
+  // zero terminated, it is interned as a symbol
+  gmcf->warmup.len = value[1].len;
+  gmcf->warmup.data = ngx_pnalloc (cf->pool, value[1].len + 1);
+  if (gmcf->warmup.data == NULL)
+    return NGX_CONF_ERROR;
+
+  *ngx_cpymem (gmcf->warmup.data, value[1].data, value[1].len) = '\0';
+
+  gmcf->warmup_iterations = n;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_guile_flight_recorder (ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf)
+{
+  ngx_http_guile_main_conf_t *gmcf = conf;
+
+  return ngx_http_guile_trace_conf (cf, &gmcf->trace);
+}
+
+/* Warm-up runs synthetic requests through the configured procedure before
+   the worker accepts connections, so that hot procedures cross the JIT
+   threshold before the first real request. */
+static ngx_int_t
+ngx_http_guile_init_process (ngx_cycle_t *cycle)
+{
+  ngx_http_guile_main_conf_t *gmcf;
+
+  gmcf = ngx_http_cycle_get_module_main_conf (cycle, ngx_http_guile_module);
+  if (gmcf == NULL)
+    return NGX_OK;
+
+  // the heap only grows when collections do not free enough
+  if (gmcf->max_heap && ngx_http_guile_initialized)
+    {
+      ngx_http_guile_max_heap = gmcf->max_heap;
+      scm_c_hook_add (&scm_after_gc_c_hook, ngx_http_guile_after_gc, NULL, 0);
+    }
+
+  if (gmcf->trace && ngx_http_guile_initialized
+      && ngx_http_guile_trace_init_process (gmcf->trace, cycle) != NGX_OK)
+    return NGX_ERROR;
+
+  if (gmcf->deadlines && ngx_http_guile_initialized
+      && ngx_http_guile_deadline_init_process (cycle) != NGX_OK)
+    return NGX_ERROR;
+
+  if (gmcf->warmup.data == NULL)
+    return NGX_OK;
+
+  if (!ngx_http_guile_initialized)
+    {
+      ngx_log_error (NGX_LOG_WARN, cycle->log, 0,
+                     "guile_warmup ignored, no guile_init_script configured");
+      return NGX_OK;
+    }
+
+  scm_with_guile (ngx_http_guile_warmup_scm, cycle);
+
+  return NGX_OK;
+}
+
+static void
+ngx_http_guile_exit_process (ngx_cycle_t *cycle)
+{
+  if (ngx_http_guile_initialized)
+    scm_with_guile (ngx_http_guile_log_stats, cycle);
+
+  ngx_http_guile_trace_exit_process (cycle);
+}
+
+/* Runs as an async after each collection, it may allocate */
+static void *
+ngx_http_guile_after_gc (void *hook_data, void *fn_data, void *data)
+{
+  if (ngx_exiting || ngx_quit)
+    return NULL;
+
+  if (ngx_http_guile_stat (scm_gc_stats (), "heap-size")
+      > ngx_http_guile_max_heap)
+    ngx_http_guile_recycle (ngx_cycle->log, "guile_max_heap exceeded");
+
+  return NULL;
+}
+
+static void *
+ngx_http_guile_log_stats (void *data)
+{
+  ngx_cycle_t *cycle = data;
+  SCM stats;
+
+  stats = scm_gc_stats ();
+
+  ngx_log_error (NGX_LOG_NOTICE, cycle->log, 0,
+                 "guile heap size: %uL, free: %uL, total allocated: %uL, "
+                 "collections: %uL, requests: %ui",
+                 ngx_http_guile_stat (stats, "heap-size"),
+                 ngx_http_guile_stat (stats, "heap-free-size"),
+                 ngx_http_guile_stat (stats, "heap-total-allocated"),
+                 ngx_http_guile_stat (stats, "gc-times"),
+                 ngx_http_guile_requests);
+
+  return NULL;
+}
+
+static uint64_t
+ngx_http_guile_stat (SCM stats, const char *name)
+{
+  return scm_to_uint64 (scm_assq_ref (stats, scm_from_utf8_symbol (name)));
+}
+
+/* Drain the worker as on SIGQUIT: listening sockets are closed, in-flight
+   requests complete and the worker exits, then the master respawns it. */
+static void
+ngx_http_guile_recycle (ngx_log_t *log, const char *reason)
+{
+  if (ngx_exiting || ngx_quit)
+    return;
+
+  ngx_log_error (NGX_LOG_NOTICE, log, 0, "%s, recycling worker process",
+                 reason);
+
+  ngx_quit = 1;
+}
+
+/* Runs the guile_warmup procedure only, route handlers are left to it */
+static void *
+ngx_http_guile_warmup_scm (void *data)
+{
+  ngx_cycle_t *cycle = data;
+  ngx_http_guile_main_conf_t *gmcf;
+  ngx_http_guile_warmup_t wu;
+  ngx_http_request_t *r;
+  ngx_http_guile_ctx_t *ctx;
+  ngx_pool_t *pool;
+  ngx_uint_t i;
+  SCM module, var;
+
+  gmcf = ngx_http_cycle_get_module_main_conf (cycle, ngx_http_guile_module);
+
+  module = scm_c_resolve_module (NGX_HTTP_GUILE_MODULE);
+  var = scm_module_variable (module,
+                             scm_from_utf8_symbol ((char *)gmcf->warmup.data));
+
+  if (scm_is_false (var))
+    {
+      ngx_log_error (NGX_LOG_ERR, cycle->log, 0,
+                     "guile_warmup procedure \"%V\" is not defined",
+                     &gmcf->warmup);
+      return NULL;
+    }
+
+  wu.cycle = cycle;
+  wu.proc = scm_variable_ref (var);
+
+  for (i = 0; i < gmcf->warmup_iterations; i++)
+    {
+      pool = ngx_create_pool (NGX_DEFAULT_POOL_SIZE, cycle->log);
+      if (pool == NULL)
+        return NULL;
+
+      r = ngx_http_guile_warmup_request (cycle, pool);
+      ctx = r ? ngx_http_guile_get_ctx (r) : NULL;
+
+      if (ctx == NULL)
+        {
+          ngx_destroy_pool (pool);
+          return NULL;
+        }
+
+      wu.request = ngx_http_guile_ctx_request (r, ctx, 0);
+
+      if (scm_is_false (scm_internal_catch (
+              SCM_BOOL_T, ngx_http_guile_warmup_body, &wu,
+              ngx_http_guile_warmup_error, &wu)))
+        {
+          ngx_destroy_pool (pool);
+          return NULL;
+        }
+
+      ngx_destroy_pool (pool);
+    }
+
+  ngx_log_debug1 (NGX_LOG_DEBUG_HTTP, cycle->log, 0,
+                  "guile warmup done, %ui iterations",
+                  gmcf->warmup_iterations);
+
+  return NULL;
+}
+
+static SCM
+ngx_http_guile_warmup_body (void *data)
+{
+  ngx_http_guile_warmup_t *wu = data;
+
+  scm_call_1 (wu->proc, wu->request);
+
+  return SCM_BOOL_T;
+}
+
+static SCM
+ngx_http_guile_warmup_error (void *data, SCM key, SCM args)
+{
+  ngx_http_guile_warmup_t *wu = data;
+  char *msg;
+
+  msg = ngx_http_guile_error_message (key, args);
+
+  ngx_log_error (NGX_LOG_WARN, wu->cycle->log, 0,
+                 "guile warmup aborted: %s", msg);
+
+  free (msg);
+
+  return SCM_BOOL_F;
+}
+
+/* A GET / with no headers, enough for the accessors and the request
+   context */
+static ngx_http_request_t *
+ngx_http_guile_warmup_request (ngx_cycle_t *cycle, ngx_pool_t *pool)
+{
+  ngx_http_conf_ctx_t *hcf;
+  ngx_http_request_t *r;
+  ngx_connection_t *c;
+
+  hcf = (ngx_http_conf_ctx_t *)cycle->conf_ctx[ngx_http_module.index];
+
+  c = ngx_pcalloc (pool, sizeof (ngx_connection_t));
+  r = ngx_pcalloc (pool, sizeof (ngx_http_request_t));
+  if (c == NULL || r == NULL)
+    return NULL;
+
+  c->log = cycle->log;
+  c->pool = pool;
+  c->fd = (ngx_socket_t)-1;
+
+  r->ctx = ngx_pcalloc (pool, sizeof (void *) * ngx_http_max_module);
+  if (r->ctx == NULL)
+    return NULL;
+
+  if (ngx_list_init (&r->headers_in.headers, pool, 1,
+                     sizeof (ngx_table_elt_t))
+          != NGX_OK
+      || ngx_list_init (&r->headers_out.headers, pool, 1,
+                        sizeof (ngx_table_elt_t))
+             != NGX_OK)
+    return NULL;
+
+  r->pool = pool;
+  r->connection = c;
+  r->main = r;
+  r->main_conf = hcf->main_conf;
+  r->srv_conf = hcf->srv_conf;
+  r->loc_conf = hcf->loc_conf;
+
+  r->method = NGX_HTTP_GET;
+  ngx_str_set (&r->method_name, "GET");
+  ngx_str_set (&r->uri, "/");
+  ngx_str_set (&r->unparsed_uri, "/");
+  ngx_str_set (&r->request_line, "GET / HTTP/1.1");
+  ngx_str_set (&r->http_protocol, "HTTP/1.1");
+  r->http_version = NGX_HTTP_VERSION_11;
+
+  r->headers_in.content_length_n = -1;
+  r->headers_in.keep_alive_n = -1;
+  r->headers_out.content_length_n = -1;
+  r->headers_out.last_modified_time = -1;
+
+  return r;
+}
@@ -0,0 +1,408 @@
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include "ngx_http_guile_regex.h"
+#include "ngx_http_guile_fields.h"
+#include "ngx_http_guile_request.h"
+
+#if (NGX_PCRE)
+
+/* Captures reported to Scheme, the whole match included */
+#define NGX_HTTP_GUILE_REGEX_CAPTURES 32
+
+#define NGX_HTTP_GUILE_REGEX_HEADER_LEN 128
+
+/* Patterns kept compiled by ngx-regex, past it a pattern is compiled for
+   each match and freed */
+#define NGX_HTTP_GUILE_REGEX_CACHE_MAX 1024
+
+/* Compiled once by ngx-regex, or for a single match */
+typedef struct
+{
+  ngx_regex_t *regex;
+  ngx_int_t captures;
+} ngx_http_guile_regex_t;
+
+static SCM ngx_http_guile_regex_scm;
+
+/* pattern string -> compiled regex */
+static SCM ngx_http_guile_regex_cache;
+static ngx_uint_t ngx_http_guile_regex_cached;
+
+/* Cached regexes are never freed, they are shared by every script and
+   survive reloads of the configuration */
+static ngx_pool_t *ngx_http_guile_regex_pool;
+
+/* Local helpers */
+
+static void compile (ngx_pool_t *pool, SCM pattern,
+                     ngx_http_guile_regex_t *re, ngx_flag_t jit,
+                     const char *subr);
+static SCM match (SCM regex, ngx_str_t *s, ngx_flag_t offsets,
+                  const char *subr);
+static void destroy_pool (void *data);
+#if (NGX_PCRE2)
+static void free_code (void *data);
+#endif
+static ngx_int_t request_field (ngx_http_request_t *r, SCM field,
+                                ngx_str_t *value, const char *subr);
+static SCM regex_exec (ngx_http_guile_regex_t *re, ngx_str_t *s,
+                       ngx_flag_t offsets, const char *subr);
+
+/* Initialization */
+
+void
+ngx_http_guile_init_regex ()
+{
+  // every guile_init_script runs this, scripts may keep compiled regexes
+  if (ngx_http_guile_regex_pool != NULL)
+    return;
+
+  ngx_http_guile_regex_pool
+      = ngx_create_pool (NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+  if (ngx_http_guile_regex_pool == NULL)
+    scm_memory_error ("ngx_http_guile_init_regex");
+
+  ngx_http_guile_regex_scm = scm_make_foreign_object_type (
+      scm_from_utf8_symbol ("ngx-regex"),
+      scm_list_1 (scm_from_utf8_symbol ("regex")), NULL);
+
+  ngx_http_guile_regex_cache
+      = scm_gc_protect_object (scm_c_make_hash_table (64));
+}
+
+/* Scheme */
+
+/* Compile pattern, or return it from the cache. Patterns are PCRE,
+   "(?i)" makes them caseless. Once the cache is full pattern is returned
+   as is, to be compiled by every match. */
+SCM
+ngx_http_guile_regex (SCM pattern)
+{
+  ngx_http_guile_regex_t *re;
+  SCM regex;
+
+  SCM_ASSERT (scm_is_string (pattern), pattern, SCM_ARG1, "ngx-regex");
+
+  regex = scm_hash_ref (ngx_http_guile_regex_cache, pattern, SCM_BOOL_F);
+  if (scm_is_true (regex))
+    return regex;
+
+  if (ngx_http_guile_regex_cached == NGX_HTTP_GUILE_REGEX_CACHE_MAX)
+    return pattern;
+
+  // the pool logs through the cycle, which changes on reload
+  ngx_http_guile_regex_pool->log = ngx_cycle->log;
+
+  re = ngx_palloc (ngx_http_guile_regex_pool, sizeof (ngx_http_guile_regex_t));
+  if (re == NULL)
+    scm_memory_error ("ngx-regex");
+
+  compile (ngx_http_guile_regex_pool, pattern, re, 1, "ngx-regex");
+
+  regex = scm_make_foreign_object_1 (ngx_http_guile_regex_scm, re);
+  // a key mutated by the script would no longer be found
+  scm_hash_set_x (ngx_http_guile_regex_cache, scm_string_copy (pattern),
+                  regex);
+  ngx_http_guile_regex_cached++;
+
+  return regex;
+}
+
+/* Captures of regex in a Scheme string, #f when it does not match */
+SCM
+ngx_http_guile_regex_match (SCM regex, SCM str)
+{
+  ngx_str_t s;
+  SCM result;
+
+  SCM_ASSERT (scm_is_string (str), str, SCM_ARG2, "ngx-regex-match");
+
+  scm_dynwind_begin (0);
+
+  s.data = (u_char *)scm_to_locale_stringn (str, &s.len);
+  scm_dynwind_free (s.data);
+
+  result = match (regex, &s, 0, "ngx-regex-match");
+
+  scm_dynwind_end ();
+
+  return result;
+}
+
+/* Captures of regex in a field of the request, matched in place. field is
+   a symbol ('uri, 'args...) or a header name. #f when the header is
+   missing or regex does not match. */
+SCM
+ngx_http_guile_request_regex_match (SCM http_request, SCM field, SCM regex)
+{
+  ngx_http_request_t *r;
+  ngx_str_t s;
+
+  r = ngx_http_guile_request_unwrap (http_request);
+
+  if (request_field (r, field, &s, "ngx-request-regex-match") != NGX_OK)
+    return SCM_BOOL_F;
+
+  return match (regex, &s, 0, "ngx-request-regex-match");
+}
+
+/* Same as ngx-request-regex-match, captures are (start . end) byte
+   offsets in the field */
+SCM
+ngx_http_guile_request_regex_offsets (SCM http_request, SCM field,
+                                      SCM regex)
+{
+  ngx_http_request_t *r;
+  ngx_str_t s;
+
+  r = ngx_http_guile_request_unwrap (http_request);
+
+  if (request_field (r, field, &s, "ngx-request-regex-offsets") != NGX_OK)
+    return SCM_BOOL_F;
+
+  return match (regex, &s, 1, "ngx-request-regex-offsets");
+}
+
+/* Local helpers impl */
+
+/* Compile pattern in pool, which owns the PCRE code. jit is set for
+   cached regexes, which are matched many times. */
+static void
+compile (ngx_pool_t *pool, SCM pattern, ngx_http_guile_regex_t *re,
+         ngx_flag_t jit, const char *subr)
+{
+#if (NGX_PCRE2)
+  ngx_pool_cleanup_t *cln;
+  pcre2_code *code;
+  PCRE2_SIZE erroff;
+  u_char errstr[NGX_MAX_CONF_ERRSTR];
+  uint32_t captures;
+  int errcode, n;
+  size_t len;
+  char *s;
+
+  cln = ngx_pool_cleanup_add (pool, 0);
+  if (cln == NULL)
+    scm_memory_error (subr);
+
+  s = scm_to_locale_stringn (pattern, &len);
+
+  // not ngx_regex_compile: its allocator only works while it runs, so the
+  // JIT of the code it returns always fails for lack of memory
+  code = pcre2_compile ((PCRE2_SPTR)s, len, 0, &errcode, &erroff, NULL);
+
+  if (code == NULL)
+    {
+      free (s);
+      pcre2_get_error_message (errcode, errstr, sizeof (errstr));
+      scm_misc_error (subr, "~A at offset ~A: ~S",
+                      scm_list_3 (scm_from_locale_string ((char *)errstr),
+                                  scm_from_size_t (erroff), pattern));
+    }
+
+  cln->handler = free_code;
+  cln->data = code;
+
+  if (jit)
+    {
+      // a failure leaves the interpreter in use
+      n = pcre2_jit_compile (code, PCRE2_JIT_COMPLETE);
+
+      if (n == 0)
+        ngx_log_debug2 (NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                        "guile regex JIT compiled: \"%*s\"", len, s);
+      else
+        ngx_log_error (NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                       "pcre2_jit_compile() failed: %d in \"%*s\"", n, len,
+                       s);
+    }
+
+  free (s);
+
+  pcre2_pattern_info (code, PCRE2_INFO_CAPTURECOUNT, &captures);
+
+  re->regex = code;
+  re->captures = captures;
+#else
+  ngx_regex_compile_t rc;
+  u_char errstr[NGX_MAX_CONF_ERRSTR];
+  size_t len;
+  char *s;
+
+  s = scm_to_locale_stringn (pattern, &len);
+
+  ngx_memzero (&rc, sizeof (ngx_regex_compile_t));
+
+  rc.pattern.len = len;
+  rc.pattern.data = ngx_pnalloc (pool, len + 1);
+  rc.pool = pool;
+  rc.err.len = NGX_MAX_CONF_ERRSTR;
+  rc.err.data = errstr;
+
+  if (rc.pattern.data == NULL)
+    {
+      free (s);
+      scm_memory_error (subr);
+    }
+
+  // zero terminated for PCRE1
+  *ngx_cpymem (rc.pattern.data, s, len) = '\0';
+  free (s);
+
+  if (ngx_regex_compile (&rc) != NGX_OK)
+    scm_misc_error (subr, "~A: ~S",
+                    scm_list_2 (scm_from_locale_stringn ((char *)rc.err.data,
+                                                         rc.err.len),
+                                pattern));
+
+  re->regex = rc.regex;
+  re->captures = rc.captures;
+#endif
+}
+
+/* regex is a compiled regex or a pattern looked up in the cache. A pattern
+   left out of a full cache is compiled in a pool destroyed once matched. */
+static SCM
+match (SCM regex, ngx_str_t *s, ngx_flag_t offsets, const char *subr)
+{
+  ngx_http_guile_regex_t re;
+  ngx_pool_t *pool;
+  SCM result;
+
+  if (scm_is_string (regex))
+    regex = ngx_http_guile_regex (regex);
+
+  if (!scm_is_string (regex))
+    {
+      scm_assert_foreign_object_type (ngx_http_guile_regex_scm, regex);
+      return regex_exec (scm_foreign_object_ref (regex, 0), s, offsets, subr);
+    }
+
+  pool = ngx_create_pool (NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+  if (pool == NULL)
+    scm_memory_error (subr);
+
+  scm_dynwind_begin (0);
+  scm_dynwind_unwind_handler (destroy_pool, pool, SCM_F_WIND_EXPLICITLY);
+
+  compile (pool, regex, &re, 0, subr);
+  result = regex_exec (&re, s, offsets, subr);
+
+  scm_dynwind_end ();
+
+  return result;
+}
+
+static void
+destroy_pool (void *data)
+{
+  ngx_destroy_pool (data);
+}
+
+#if (NGX_PCRE2)
+static void
+free_code (void *data)
+{
+  pcre2_code_free (data);
+}
+#endif
+
+static ngx_int_t
+request_field (ngx_http_request_t *r, SCM field, ngx_str_t *value,
+               const char *subr)
+{
+  ngx_table_elt_t *h;
+  size_t offset;
+  u_char name[NGX_HTTP_GUILE_REGEX_HEADER_LEN];
+  size_t len;
+
+  if (scm_is_symbol (field))
+    {
+      if (ngx_http_guile_field_offset (field, &offset) == NGX_OK)
+        {
+          *value = *(ngx_str_t *)((char *)r + offset);
+          return NGX_OK;
+        }
+
+      scm_misc_error (subr, "unknown request field ~S", scm_list_1 (field));
+    }
+
+  SCM_ASSERT (scm_is_string (field), field, SCM_ARG2, subr);
+
+  // no allocation for the name, headers are matched on every request
+  len = scm_to_locale_stringbuf (field, (char *)name, sizeof (name));
+  if (len > sizeof (name))
+    scm_misc_error (subr, "header name too long: ~S", scm_list_1 (field));
+
+  h = ngx_http_guile_request_find_header_in (r, name, len);
+  if (h == NULL)
+    return NGX_DECLINED;
+
+  *value = h->value;
+
+  return NGX_OK;
+}
+
+static SCM
+regex_exec (ngx_http_guile_regex_t *re, ngx_str_t *s, ngx_flag_t offsets,
+            const char *subr)
+{
+  int captures[NGX_HTTP_GUILE_REGEX_CAPTURES * 3];
+  ngx_int_t rc, i, n;
+  SCM result, capture;
+
+  n = ngx_min (re->captures + 1, NGX_HTTP_GUILE_REGEX_CAPTURES);
+
+  rc = ngx_regex_exec (re->regex, s, captures, n * 3);
+
+  if (rc == NGX_REGEX_NO_MATCHED)
+    return SCM_BOOL_F;
+
+  if (rc < 0)
+    scm_misc_error (subr, "regex match failed: ~A",
+                    scm_list_1 (scm_from_long (rc)));
+
+  // 0 when there are more captures than reported
+  if (rc == 0)
+    rc = n;
+
+  result = scm_c_make_vector (n, SCM_BOOL_F);
+
+  for (i = 0; i < rc; i++)
+    {
+      // unset group
+      if (captures[2 * i] < 0)
+        continue;
+
+      if (offsets)
+        capture = scm_cons (scm_from_int (captures[2 * i]),
+                            scm_from_int (captures[2 * i + 1]));
+      else
+        capture = scm_from_locale_stringn (
+            (char *)s->data + captures[2 * i],
+            captures[2 * i + 1] - captures[2 * i]);
+
+      SCM_SIMPLE_VECTOR_SET (result, i, capture);
+    }
+
+  return result;
+}
+
+#endif
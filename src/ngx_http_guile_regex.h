@@ -0,0 +1,45 @@
+#ifndef _NGX_HTTP_GUILE_REGEX_INCLUDED_
+#define _NGX_HTTP_GUILE_REGEX_INCLUDED_
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+// ngx must be included first
+#include <libguile.h>
+
+#if (NGX_PCRE)
+
+/* Initialization */
+
+void ngx_http_guile_init_regex ();
+
+/* Scheme */
+
+SCM ngx_http_guile_regex (SCM pattern);
+SCM ngx_http_guile_regex_match (SCM regex, SCM str);
+SCM ngx_http_guile_request_regex_match (SCM http_request, SCM field,
+                                        SCM regex);
+SCM ngx_http_guile_request_regex_offsets (SCM http_request, SCM field,
+                                          SCM regex);
+
+#endif
+
+#endif /* _NGX_HTTP_GUILE_REGEX_INCLUDED_ */
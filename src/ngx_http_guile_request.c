@@ -18,17 +18,67 @@
  * <https://www.gnu.org/licenses/>.
  */
 #include "ngx_http_guile_request.h"
+#include "ngx_http_guile_trace.h"
+#include "ngx_guile_string.h"
 
 // TODO dangerous global, move it in configuration scope
 static SCM ngx_http_guile_request_scm;
 
+typedef struct
+{
+  ngx_uint_t method;
+  char *name;
+} ngx_http_guile_method_t;
+
+static ngx_http_guile_method_t ngx_http_guile_methods[] = {
+  { NGX_HTTP_GET, "GET" },
+  { NGX_HTTP_HEAD, "HEAD" },
+  { NGX_HTTP_POST, "POST" },
+  { NGX_HTTP_PUT, "PUT" },
+  { NGX_HTTP_DELETE, "DELETE" },
+  { NGX_HTTP_MKCOL, "MKCOL" },
+  { NGX_HTTP_COPY, "COPY" },
+  { NGX_HTTP_MOVE, "MOVE" },
+  { NGX_HTTP_OPTIONS, "OPTIONS" },
+  { NGX_HTTP_PROPFIND, "PROPFIND" },
+  { NGX_HTTP_PROPPATCH, "PROPPATCH" },
+  { NGX_HTTP_LOCK, "LOCK" },
+  { NGX_HTTP_UNLOCK, "UNLOCK" },
+  { NGX_HTTP_PATCH, "PATCH" },
+  { NGX_HTTP_TRACE, "TRACE" },
+  { NGX_HTTP_CONNECT, "CONNECT" },
+};
+
+#define NGX_HTTP_GUILE_METHODS_N                                              \
+  (sizeof (ngx_http_guile_methods) / sizeof (ngx_http_guile_method_t))
+
+/* Method symbols are interned once at init, so that the accessor does not
+   touch the symbol table on every request */
+static SCM ngx_http_guile_method_symbols[NGX_HTTP_GUILE_METHODS_N];
+
 /* Local helpers */
 
-static ngx_http_request_t *unwrap_http_request (SCM http_request);
-static SCM scm_from_ngx_string (ngx_str_t str);
+static ngx_http_request_t *unwrap_http_request_at (SCM http_request,
+                                                   const char *func);
+static ngx_http_guile_request_t *unwrap_store_at (SCM http_request,
+                                                  ngx_flag_t create,
+                                                  const char *func);
+static void ngx_http_guile_ctx_cleanup (void *data);
+static void *ngx_http_guile_ctx_unprotect (void *data);
+static SCM scm_from_ngx_header (ngx_table_elt_t *h);
+static SCM scm_from_ngx_off (off_t n);
+static SCM lookup_parsed (SCM table, SCM key);
+static void parse_pairs (SCM table, u_char *p, u_char *last, u_char sep);
 static ngx_table_elt_t *search_hashed_headers_in (ngx_http_request_t *r,
                                                   u_char *name, size_t len);
 
+/* Primitives are recorded by the flight recorder when they unwrap the
+   request */
+#define unwrap_http_request(http_request)                                     \
+  unwrap_http_request_at (http_request, __func__)
+#define unwrap_store(http_request, create)                                    \
+  unwrap_store_at (http_request, create, __func__)
+
 /* Initializations */
 
 void
@@ -36,6 +86,7 @@ ngx_http_guile_init_req_foreign_type ()
 {
   SCM name, slots;
   scm_t_struct_finalize finalizer;
+  ngx_uint_t i;
 
   name = scm_from_utf8_symbol ("ngx-http-request");
 
@@ -46,6 +97,30 @@ ngx_http_guile_init_req_foreign_type ()
 
   ngx_http_guile_request_scm
       = scm_make_foreign_object_type (name, slots, finalizer);
+
+  for (i = 0; i < NGX_HTTP_GUILE_METHODS_N; i++)
+    {
+      ngx_http_guile_method_symbols[i] = scm_gc_protect_object (
+          scm_from_utf8_symbol (ngx_http_guile_methods[i].name));
+    }
+}
+
+/* Method bit (NGX_HTTP_GET...) from its name, NGX_HTTP_UNKNOWN if none */
+ngx_uint_t
+ngx_http_guile_method_from_name (u_char *name, size_t len)
+{
+  ngx_uint_t i;
+
+  for (i = 0; i < NGX_HTTP_GUILE_METHODS_N; i++)
+    {
+      if (ngx_strlen (ngx_http_guile_methods[i].name) == len
+          && ngx_strncasecmp ((u_char *)ngx_http_guile_methods[i].name, name,
+                              len)
+                 == 0)
+        return ngx_http_guile_methods[i].method;
+    }
+
+  return NGX_HTTP_UNKNOWN;
 }
 
 /* Constructors */
@@ -60,10 +135,147 @@ ngx_http_guile_request_c_make (char *name, ngx_http_request_t *r)
 
   req_scm->name = scm_from_utf8_symbol (name);
   req_scm->http_request = r;
+  req_scm->args = SCM_BOOL_F;
+  req_scm->cookies = SCM_BOOL_F;
+  req_scm->store = SCM_BOOL_F;
 
   return scm_make_foreign_object_1 (ngx_http_guile_request_scm, req_scm);
 }
 
+/* Access the nginx request from other primitives, func is the caller */
+ngx_http_request_t *
+ngx_http_guile_request_unwrap_at (SCM http_request, const char *func)
+{
+  return unwrap_http_request_at (http_request, func);
+}
+
+/* Get or create the module context of r. It is plain C and can be used
+   outside of guile mode, the wrapper is created by
+   ngx_http_guile_ctx_request. */
+ngx_http_guile_ctx_t *
+ngx_http_guile_get_ctx (ngx_http_request_t *r)
+{
+  ngx_http_guile_ctx_t *ctx;
+  ngx_pool_cleanup_t *cln;
+
+  ctx = ngx_http_get_module_ctx (r, ngx_http_guile_module);
+  if (ctx != NULL)
+    return ctx;
+
+  ctx = ngx_pcalloc (r->pool, sizeof (ngx_http_guile_ctx_t));
+  if (ctx == NULL)
+    return NULL;
+
+  cln = ngx_pool_cleanup_add (r->pool, 0);
+  if (cln == NULL)
+    return NULL;
+
+  ctx->request = SCM_BOOL_F;
+
+  cln->handler = ngx_http_guile_ctx_cleanup;
+  cln->data = ctx;
+
+  ngx_http_set_ctx (r, ctx, ngx_http_guile_module);
+
+  return ctx;
+}
+
+/* The wrapper of r, created on first use. It is GC-protected for the
+   lifetime of the request and unprotected by a r->pool cleanup. When
+   inherit is set, a subrequest shares the storage of its parent. */
+SCM
+ngx_http_guile_ctx_request (ngx_http_request_t *r, ngx_http_guile_ctx_t *ctx,
+                            ngx_flag_t inherit)
+{
+  ngx_http_guile_ctx_t *pctx;
+  ngx_http_guile_request_t *req, *preq;
+
+  if (scm_is_true (ctx->request))
+    return ctx->request;
+
+  // TODO unique request name
+  ctx->request
+      = scm_gc_protect_object (ngx_http_guile_request_c_make ("my-req", r));
+
+  if (inherit && r != r->main)
+    {
+      pctx = ngx_http_guile_get_ctx (r->parent);
+      if (pctx == NULL)
+        scm_memory_error ("ngx_http_guile_get_ctx");
+
+      preq = unwrap_store (ngx_http_guile_ctx_request (r->parent, pctx, 0),
+                           1);
+      req = scm_foreign_object_ref (ctx->request, 0);
+      req->store = preq->store;
+    }
+
+  return ctx->request;
+}
+
+static void
+ngx_http_guile_ctx_cleanup (void *data)
+{
+  ngx_http_guile_ctx_t *ctx = data;
+
+  if (scm_is_false (ctx->request))
+    return;
+
+  // pool cleanups run outside of guile mode
+  scm_with_guile (ngx_http_guile_ctx_unprotect, data);
+}
+
+static void *
+ngx_http_guile_ctx_unprotect (void *data)
+{
+  ngx_http_guile_ctx_t *ctx = data;
+  ngx_http_guile_request_t *req;
+
+  // the request is gone, wrappers kept alive by scripts must not use it
+  req = scm_foreign_object_ref (ctx->request, 0);
+  req->http_request = NULL;
+
+  scm_gc_unprotect_object (ctx->request);
+
+  return NULL;
+}
+
+/* Header sent by the client. Known headers are found through their
+   headers_in field, others by a scan of the list. */
+ngx_table_elt_t *
+ngx_http_guile_request_find_header_in (ngx_http_request_t *r, u_char *name,
+                                       size_t len)
+{
+  ngx_list_part_t *part;
+  ngx_table_elt_t *h;
+  ngx_uint_t i;
+
+  h = search_hashed_headers_in (r, name, len);
+  if (h != NULL)
+    return h;
+
+  part = &r->headers_in.headers.part;
+  h = part->elts;
+
+  for (i = 0; /* void */; i++)
+    {
+      if (i >= part->nelts)
+        {
+          if (part->next == NULL)
+            break;
+
+          part = part->next;
+          h = part->elts;
+          i = 0;
+        }
+
+      if (h[i].key.len == len
+          && ngx_strncasecmp (h[i].key.data, name, len) == 0)
+        return &h[i];
+    }
+
+  return NULL;
+}
+
 /* Accessors */
 
 SCM
@@ -95,28 +307,32 @@ ngx_http_guile_request_method (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  char *method;
-  switch (r->method)
+  return scm_from_ngx_string (r->method_name);
+}
+
+SCM
+ngx_http_guile_request_method_symbol (SCM http_request)
+{
+  ngx_http_request_t *r = unwrap_http_request (http_request);
+
+  return ngx_http_guile_method_symbol (r);
+}
+
+/* Interned symbol of the request method, for C callers holding r */
+SCM
+ngx_http_guile_method_symbol (ngx_http_request_t *r)
+{
+  ngx_uint_t i;
+
+  for (i = 0; i < NGX_HTTP_GUILE_METHODS_N; i++)
     {
-    // TODO other methods
-    case NGX_HTTP_GET:
-      method = "GET";
-      break;
-    case NGX_HTTP_POST:
-      method = "POST";
-      break;
-    case NGX_HTTP_PUT:
-      method = "PUT";
-      break;
-    case NGX_HTTP_DELETE:
-      method = "DELETE";
-      break;
-    default:
-      // TODO
-      method = "GET";
+      if (r->method == ngx_http_guile_methods[i].method)
+        return ngx_http_guile_method_symbols[i];
     }
 
-  return scm_from_utf8_string (method);
+  // unknown method, intern whatever the client sent
+  return scm_from_utf8_symboln ((char *)r->method_name.data,
+                                r->method_name.len);
 }
 
 SCM
@@ -163,7 +379,7 @@ ngx_http_guile_request_header_in (SCM http_request, SCM header_name)
   header = search_hashed_headers_in (r, (u_char *)header_key,
                                      ngx_strlen (header_key));
 
-  return scm_from_ngx_string (header->value);
+  return scm_from_ngx_header (header);
 }
 
 SCM
@@ -171,7 +387,7 @@ ngx_http_guile_request_header_host (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.host->value);
+  return scm_from_ngx_header (r->headers_in.host);
 }
 
 SCM
@@ -179,7 +395,7 @@ ngx_http_guile_request_header_connection (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.connection->value);
+  return scm_from_ngx_header (r->headers_in.connection);
 }
 
 SCM
@@ -187,7 +403,7 @@ ngx_http_guile_request_header_if_modified_since (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.if_modified_since->value);
+  return scm_from_ngx_header (r->headers_in.if_modified_since);
 }
 
 SCM
@@ -195,7 +411,7 @@ ngx_http_guile_request_header_if_unmodified_since (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.if_unmodified_since->value);
+  return scm_from_ngx_header (r->headers_in.if_unmodified_since);
 }
 
 SCM
@@ -203,7 +419,7 @@ ngx_http_guile_request_header_if_match (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.if_match->value);
+  return scm_from_ngx_header (r->headers_in.if_match);
 }
 
 SCM
@@ -211,7 +427,7 @@ ngx_http_guile_request_header_if_none_match (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.if_none_match->value);
+  return scm_from_ngx_header (r->headers_in.if_none_match);
 }
 
 SCM
@@ -219,7 +435,7 @@ ngx_http_guile_request_header_user_agent (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.user_agent->value);
+  return scm_from_ngx_header (r->headers_in.user_agent);
 }
 
 SCM
@@ -227,7 +443,7 @@ ngx_http_guile_request_header_referer (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.referer->value);
+  return scm_from_ngx_header (r->headers_in.referer);
 }
 
 SCM
@@ -235,7 +451,7 @@ ngx_http_guile_request_header_content_length (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.content_length->value);
+  return scm_from_ngx_header (r->headers_in.content_length);
 }
 
 SCM
@@ -243,7 +459,7 @@ ngx_http_guile_request_header_content_range (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.content_range->value);
+  return scm_from_ngx_header (r->headers_in.content_range);
 }
 
 SCM
@@ -251,7 +467,7 @@ ngx_http_guile_request_header_content_type (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.content_type->value);
+  return scm_from_ngx_header (r->headers_in.content_type);
 }
 
 SCM
@@ -259,7 +475,7 @@ ngx_http_guile_request_header_range (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.range->value);
+  return scm_from_ngx_header (r->headers_in.range);
 }
 
 SCM
@@ -267,7 +483,7 @@ ngx_http_guile_request_header_if_range (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.if_range->value);
+  return scm_from_ngx_header (r->headers_in.if_range);
 }
 
 SCM
@@ -275,7 +491,7 @@ ngx_http_guile_request_header_transfer_encoding (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.transfer_encoding->value);
+  return scm_from_ngx_header (r->headers_in.transfer_encoding);
 }
 
 SCM
@@ -283,7 +499,7 @@ ngx_http_guile_request_header_te (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.te->value);
+  return scm_from_ngx_header (r->headers_in.te);
 }
 
 SCM
@@ -291,7 +507,7 @@ ngx_http_guile_request_header_expect (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.expect->value);
+  return scm_from_ngx_header (r->headers_in.expect);
 }
 
 SCM
@@ -299,7 +515,7 @@ ngx_http_guile_request_header_upgrade (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.upgrade->value);
+  return scm_from_ngx_header (r->headers_in.upgrade);
 }
 
 #if (NGX_HTTP_GZIP || NGX_HTTP_HEADERS)
@@ -309,7 +525,7 @@ ngx_http_guile_request_header_accept_encoding (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.accept_encoding->value);
+  return scm_from_ngx_header (r->headers_in.accept_encoding);
 }
 
 SCM
@@ -317,7 +533,7 @@ ngx_http_guile_request_header_via (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.via->value);
+  return scm_from_ngx_header (r->headers_in.via);
 }
 
 #endif
@@ -327,7 +543,7 @@ ngx_http_guile_request_header_authorization (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.authorization->value);
+  return scm_from_ngx_header (r->headers_in.authorization);
 }
 
 SCM
@@ -335,7 +551,7 @@ ngx_http_guile_request_header_keep_alive (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.keep_alive->value);
+  return scm_from_ngx_header (r->headers_in.keep_alive);
 }
 
 #if (NGX_HTTP_X_FORWARDED_FOR)
@@ -345,7 +561,7 @@ ngx_http_guile_request_header_x_forwarded_for (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.x_forwarded_for->value);
+  return scm_from_ngx_header (r->headers_in.x_forwarded_for);
 }
 
 #endif
@@ -363,7 +579,7 @@ ngx_http_guile_request_header_accept (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.accept->value);
+  return scm_from_ngx_header (r->headers_in.accept);
 }
 
 SCM
@@ -371,7 +587,7 @@ ngx_http_guile_request_header_accept_language (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.accept_language->value);
+  return scm_from_ngx_header (r->headers_in.accept_language);
 }
 
 #endif
@@ -383,7 +599,7 @@ ngx_http_guile_request_header_depth (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.depth->value);
+  return scm_from_ngx_header (r->headers_in.depth);
 }
 
 SCM
@@ -391,7 +607,7 @@ ngx_http_guile_request_header_destination (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.destination->value);
+  return scm_from_ngx_header (r->headers_in.destination);
 }
 
 SCM
@@ -399,7 +615,7 @@ ngx_http_guile_request_header_overwrite (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.overwrite->value);
+  return scm_from_ngx_header (r->headers_in.overwrite);
 }
 
 SCM
@@ -407,7 +623,7 @@ ngx_http_guile_request_header_date (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.date->value);
+  return scm_from_ngx_header (r->headers_in.date);
 }
 
 #endif
@@ -417,7 +633,111 @@ ngx_http_guile_request_header_cookie (SCM http_request)
 {
   ngx_http_request_t *r = unwrap_http_request (http_request);
 
-  return scm_from_ngx_string (r->headers_in.cookie->value);
+  return scm_from_ngx_header (r->headers_in.cookie);
+}
+
+/* Parsed views
+
+   Args and cookies are split in C on first access and memoized on the
+   request wrapper as hash tables keyed by lowercase name, so following
+   lookups do not scan the raw strings again. Like ngx_http_arg, names are
+   matched case-insensitively and the first occurrence wins; values are
+   returned raw, without unescaping. */
+
+SCM
+ngx_http_guile_request_arg (SCM http_request, SCM name)
+{
+  ngx_http_guile_request_t *req;
+  ngx_http_request_t *r;
+
+  r = unwrap_http_request (http_request);
+  req = scm_foreign_object_ref (http_request, 0);
+
+  if (scm_is_false (req->args))
+    {
+      req->args = scm_c_make_hash_table (8);
+      parse_pairs (req->args, r->args.data, r->args.data + r->args.len, '&');
+    }
+
+  return lookup_parsed (req->args, name);
+}
+
+SCM
+ngx_http_guile_request_cookie (SCM http_request, SCM name)
+{
+  ngx_http_guile_request_t *req;
+  ngx_http_request_t *r;
+  ngx_table_elt_t *h;
+
+  r = unwrap_http_request (http_request);
+  req = scm_foreign_object_ref (http_request, 0);
+
+  if (scm_is_false (req->cookies))
+    {
+      req->cookies = scm_c_make_hash_table (8);
+
+      // multiple Cookie headers are chained by nginx
+      for (h = r->headers_in.cookie; h; h = h->next)
+        parse_pairs (req->cookies, h->value.data,
+                     h->value.data + h->value.len, ';');
+    }
+
+  return lookup_parsed (req->cookies, name);
+}
+
+/* Typed fields already parsed by nginx */
+
+SCM
+ngx_http_guile_request_content_length_n (SCM http_request)
+{
+  ngx_http_request_t *r = unwrap_http_request (http_request);
+
+  return scm_from_ngx_off (r->headers_in.content_length_n);
+}
+
+SCM
+ngx_http_guile_request_keep_alive_n (SCM http_request)
+{
+  ngx_http_request_t *r = unwrap_http_request (http_request);
+
+  return scm_from_ngx_off (r->headers_in.keep_alive_n);
+}
+
+/* Request-scoped storage */
+
+SCM
+ngx_http_guile_request_ctx_ref (SCM http_request, SCM key, SCM dflt)
+{
+  ngx_http_guile_request_t *req = unwrap_store (http_request, 0);
+
+  if (SCM_UNBNDP (dflt))
+    dflt = SCM_BOOL_F;
+
+  if (scm_is_false (req->store))
+    return dflt;
+
+  return scm_hash_ref (req->store, key, dflt);
+}
+
+SCM
+ngx_http_guile_request_ctx_set_x (SCM http_request, SCM key, SCM value)
+{
+  ngx_http_guile_request_t *req = unwrap_store (http_request, 1);
+
+  scm_hash_set_x (req->store, key, value);
+
+  return SCM_UNSPECIFIED;
+}
+
+SCM
+ngx_http_guile_request_ctx_delete_x (SCM http_request, SCM key)
+{
+  ngx_http_guile_request_t *req = unwrap_store (http_request, 0);
+
+  if (scm_is_true (req->store))
+    scm_hash_remove_x (req->store, key);
+
+  return SCM_UNSPECIFIED;
 }
 
 SCM
@@ -439,19 +759,101 @@ ngx_http_guile_request_passwd (SCM http_request)
 /* Local helpers impl */
 
 static ngx_http_request_t *
-unwrap_http_request (SCM http_request)
+unwrap_http_request_at (SCM http_request, const char *func)
 {
+  ngx_http_guile_trace (NGX_HTTP_GUILE_TRACE_INSTANT, func);
+
   scm_assert_foreign_object_type (ngx_http_guile_request_scm, http_request);
 
   ngx_http_guile_request_t *r = scm_foreign_object_ref (http_request, 0);
 
+  if (r->http_request == NULL)
+    scm_misc_error ("unwrap-http-request", "request already finalized: ~S",
+                    scm_list_1 (http_request));
+
   return r->http_request;
 }
 
+static ngx_http_guile_request_t *
+unwrap_store_at (SCM http_request, ngx_flag_t create, const char *func)
+{
+  ngx_http_guile_request_t *req;
+
+  unwrap_http_request_at (http_request, func);
+  req = scm_foreign_object_ref (http_request, 0);
+
+  if (create && scm_is_false (req->store))
+    req->store = scm_c_make_hash_table (8);
+
+  return req;
+}
+
+/* Headers not sent by the client are NULL */
 static SCM
-scm_from_ngx_string (ngx_str_t str)
+scm_from_ngx_header (ngx_table_elt_t *h)
 {
-  return scm_from_locale_stringn ((char *)str.data, str.len);
+  if (h == NULL)
+    return SCM_BOOL_F;
+
+  return scm_from_ngx_string (h->value);
+}
+
+/* nginx uses -1 for fields not present in the request */
+static SCM
+scm_from_ngx_off (off_t n)
+{
+  if (n < 0)
+    return SCM_BOOL_F;
+
+  return scm_from_int64 (n);
+}
+
+static SCM
+lookup_parsed (SCM table, SCM key)
+{
+  if (scm_is_symbol (key))
+    key = scm_symbol_to_string (key);
+
+  return scm_hash_ref (table, scm_string_downcase (key), SCM_BOOL_F);
+}
+
+/* Split "name=value<sep>name=value" pairs into table. Entries without '='
+   are skipped, as ngx_http_arg would never match them. */
+static void
+parse_pairs (SCM table, u_char *p, u_char *last, u_char sep)
+{
+  u_char *name, *name_end, *value, *end;
+  SCM key;
+
+  while (p < last)
+    {
+      while (p < last && (*p == ' ' || *p == '\t'))
+        p++;
+
+      end = ngx_strlchr (p, last, sep);
+      if (end == NULL)
+        end = last;
+
+      name = p;
+      name_end = ngx_strlchr (name, end, '=');
+      p = end + 1;
+
+      if (name_end == NULL || name_end == name)
+        continue;
+
+      value = name_end + 1;
+      while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+      // lowercase a copy, the raw buffer still belongs to the request
+      key = scm_string_downcase_x (
+          scm_from_locale_stringn ((char *)name, name_end - name));
+
+      // first occurrence wins
+      if (scm_is_false (scm_hash_get_handle (table, key)))
+        scm_hash_set_x (table, key,
+                        scm_from_locale_stringn ((char *)value, end - value));
+    }
 }
 
 /* Function copied from here:
@@ -32,15 +32,51 @@ typedef struct
 
   SCM name;
   SCM update_func;
+
+  /* memoized parsed views, #f until first access */
+  SCM args;
+  SCM cookies;
+
+  /* request-scoped storage, #f until first set */
+  SCM store;
 } ngx_http_guile_request_t;
 
+/* Per-request module context, attached to r with ngx_http_set_ctx so that
+   the same wrapper is seen by every phase */
+typedef struct
+{
+  SCM request;
+
+  /* parsed request body fields, NULL until first access */
+  struct ngx_http_guile_form_s *form;
+
+  unsigned body_requested : 1;
+  unsigned body_read : 1;
+} ngx_http_guile_ctx_t;
+
+extern ngx_module_t ngx_http_guile_module;
+
+/* The caller is recorded by the flight recorder */
+#define ngx_http_guile_request_unwrap(http_request)                           \
+  ngx_http_guile_request_unwrap_at (http_request, __func__)
+
 /* Constructors */
 
 SCM ngx_http_guile_request_c_make (char *name, ngx_http_request_t *r);
+ngx_http_request_t *ngx_http_guile_request_unwrap_at (SCM http_request,
+                                                      const char *func);
+ngx_http_guile_ctx_t *ngx_http_guile_get_ctx (ngx_http_request_t *r);
+SCM ngx_http_guile_ctx_request (ngx_http_request_t *r,
+                                ngx_http_guile_ctx_t *ctx, ngx_flag_t inherit);
+ngx_table_elt_t *ngx_http_guile_request_find_header_in (ngx_http_request_t *r,
+                                                       u_char *name,
+                                                       size_t len);
 
 /* Initialization */
 
 void ngx_http_guile_init_req_foreign_type ();
+ngx_uint_t ngx_http_guile_method_from_name (u_char *name, size_t len);
+SCM ngx_http_guile_method_symbol (ngx_http_request_t *r);
 
 /* Accessors */
 
@@ -48,6 +84,7 @@ SCM ngx_http_guile_request_http_version (SCM http_request);
 SCM ngx_http_guile_request_http_protocol (SCM http_request);
 SCM ngx_http_guile_request_request_line (SCM http_request);
 SCM ngx_http_guile_request_method (SCM http_request);
+SCM ngx_http_guile_request_method_symbol (SCM http_request);
 SCM ngx_http_guile_request_uri (SCM http_request);
 SCM ngx_http_guile_request_args (SCM http_request);
 SCM ngx_http_guile_request_exten (SCM http_request);
@@ -103,6 +140,16 @@ SCM ngx_http_guile_request_header_date (SCM http_request);
 
 SCM ngx_http_guile_request_header_cookie (SCM http_request);
 
+SCM ngx_http_guile_request_arg (SCM http_request, SCM name);
+SCM ngx_http_guile_request_cookie (SCM http_request, SCM name);
+
+SCM ngx_http_guile_request_content_length_n (SCM http_request);
+SCM ngx_http_guile_request_keep_alive_n (SCM http_request);
+
+SCM ngx_http_guile_request_ctx_ref (SCM http_request, SCM key, SCM dflt);
+SCM ngx_http_guile_request_ctx_set_x (SCM http_request, SCM key, SCM value);
+SCM ngx_http_guile_request_ctx_delete_x (SCM http_request, SCM key);
+
 SCM ngx_http_guile_request_user (SCM http_request);
 SCM ngx_http_guile_request_passwd (SCM http_request);
 
@@ -0,0 +1,513 @@
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include "ngx_http_guile_route.h"
+#include "ngx_http_guile_request.h"
+
+/* Table receiving ngx-route! declarations, only set while loading the init
+   script */
+static ngx_http_guile_routes_t *ngx_http_guile_routes_current;
+
+/* Local helpers */
+
+static ngx_http_guile_route_node_t *create_node (ngx_pool_t *pool,
+                                                 u_char *segment, size_t len);
+static ngx_http_guile_route_node_t *
+child_node (ngx_pool_t *pool, ngx_http_guile_route_node_t *node,
+            u_char *segment, size_t len, char **err);
+static ngx_http_guile_route_node_t *
+find_child (ngx_http_guile_route_node_t *node, u_char *segment, size_t len,
+            ngx_uint_t *pos);
+static ngx_int_t walk (ngx_http_guile_route_node_t *node, u_char *p,
+                       u_char *last, ngx_uint_t method,
+                       ngx_http_guile_route_match_t *match);
+static ngx_int_t find_handler (ngx_http_guile_route_node_t *node,
+                               ngx_uint_t method,
+                               ngx_http_guile_route_match_t *match);
+static void routes_cleanup (void *data);
+static void *routes_unprotect (void *data);
+static void unprotect_node (ngx_http_guile_route_node_t *node);
+
+/* Constructors */
+
+ngx_http_guile_routes_t *
+ngx_http_guile_routes_create (ngx_pool_t *pool)
+{
+  ngx_http_guile_routes_t *routes;
+  ngx_pool_cleanup_t *cln;
+
+  routes = ngx_palloc (pool, sizeof (ngx_http_guile_routes_t));
+  if (routes == NULL)
+    return NULL;
+
+  routes->pool = pool;
+  routes->root = create_node (pool, NULL, 0);
+  if (routes->root == NULL)
+    return NULL;
+
+  // the tree is rebuilt on reload, release the Scheme values of the old one
+  cln = ngx_pool_cleanup_add (pool, 0);
+  if (cln == NULL)
+    return NULL;
+
+  cln->handler = routes_cleanup;
+  cln->data = routes;
+
+  return routes;
+}
+
+/* Compile pattern into the trie, returning the handler slot for the caller
+   to fill. Patterns look like "/users/:id/files/*path". */
+ngx_http_guile_route_handler_t *
+ngx_http_guile_route_add (ngx_http_guile_routes_t *routes, ngx_uint_t methods,
+                          ngx_str_t *pattern, char **err)
+{
+  ngx_http_guile_route_node_t *node;
+  ngx_http_guile_route_handler_t *h;
+  u_char *p, *last, *end;
+  ngx_uint_t i;
+
+  p = pattern->data;
+  last = p + pattern->len;
+
+  if (pattern->len == 0 || *p != '/')
+    {
+      *err = "route pattern must start with \"/\"";
+      return NULL;
+    }
+
+  node = routes->root;
+
+  while (p < last)
+    {
+      p++;
+      end = ngx_strlchr (p, last, '/');
+      if (end == NULL)
+        end = last;
+
+      if (end - p > 1 && *p == '*' && end != last)
+        {
+          *err = "wildcard parameter must be the last segment";
+          return NULL;
+        }
+
+      node = child_node (routes->pool, node, p, end - p, err);
+      if (node == NULL)
+        return NULL;
+
+      p = end;
+    }
+
+  h = node->handlers.elts;
+  for (i = 0; i < node->handlers.nelts; i++)
+    {
+      if (h[i].methods == 0 || methods == 0 || (h[i].methods & methods))
+        {
+          *err = "duplicate route";
+          return NULL;
+        }
+    }
+
+  h = ngx_array_push (&node->handlers);
+  if (h == NULL)
+    {
+      *err = NGX_CONF_ERROR;
+      return NULL;
+    }
+
+  ngx_memzero (h, sizeof (ngx_http_guile_route_handler_t));
+  h->methods = methods;
+  h->var = SCM_BOOL_F;
+  h->proc = SCM_BOOL_F;
+
+  return h;
+}
+
+/* Matching */
+
+/* Runs in C before entering Guile, the parameters point into r->uri */
+ngx_int_t
+ngx_http_guile_route_find (ngx_http_guile_routes_t *routes,
+                           ngx_http_request_t *r,
+                           ngx_http_guile_route_match_t *match)
+{
+  match->handler = NULL;
+  match->nparams = 0;
+
+  if (r->uri.len == 0 || r->uri.data[0] != '/')
+    return NGX_DECLINED;
+
+  return walk (routes->root, r->uri.data, r->uri.data + r->uri.len,
+               r->method, match);
+}
+
+SCM
+ngx_http_guile_route_proc (ngx_http_guile_route_handler_t *handler,
+                           SCM module)
+{
+  if (scm_is_true (handler->proc))
+    return handler->proc;
+
+  if (scm_is_false (handler->var))
+    {
+      handler->var = scm_module_variable (
+          module, scm_from_utf8_symbol ((char *)handler->name.data));
+
+      if (scm_is_false (handler->var))
+        scm_misc_error ("ngx-route", "route procedure ~A is not defined",
+                        scm_list_1 (scm_from_utf8_symbol (
+                            (char *)handler->name.data)));
+    }
+
+  return scm_variable_ref (handler->var);
+}
+
+/* Alist of (param-symbol . value) */
+SCM
+ngx_http_guile_route_params (ngx_http_guile_route_match_t *match)
+{
+  ngx_http_guile_route_node_t *node;
+  ngx_uint_t i;
+  SCM params;
+
+  params = SCM_EOL;
+
+  for (i = match->nparams; i > 0; i--)
+    {
+      node = match->params[i - 1].node;
+
+      if (scm_is_false (node->param_sym))
+        node->param_sym = scm_gc_protect_object (scm_from_utf8_symboln (
+            (char *)node->segment.data + 1, node->segment.len - 1));
+
+      params = scm_acons (node->param_sym,
+                          scm_from_locale_stringn (
+                              (char *)match->params[i - 1].value.data,
+                              match->params[i - 1].value.len),
+                          params);
+    }
+
+  return params;
+}
+
+/* Declaration from Scheme */
+
+void
+ngx_http_guile_route_set_current (ngx_http_guile_routes_t *routes)
+{
+  ngx_http_guile_routes_current = routes;
+}
+
+SCM
+ngx_http_guile_route_define (SCM method, SCM pattern, SCM proc)
+{
+  ngx_http_guile_route_handler_t *h;
+  ngx_uint_t methods;
+  ngx_str_t str;
+  char *name, *err;
+  size_t len;
+
+  if (ngx_http_guile_routes_current == NULL)
+    scm_misc_error ("ngx-route!",
+                    "routes can only be declared by the init script",
+                    SCM_EOL);
+
+  SCM_ASSERT (scm_is_true (scm_procedure_p (proc)), proc, SCM_ARG3,
+              "ngx-route!");
+
+  if (scm_is_symbol (method))
+    method = scm_symbol_to_string (method);
+
+  name = scm_to_locale_stringn (method, &len);
+  if (len == 1 && name[0] == '*')
+    methods = 0;
+  else
+    methods = ngx_http_guile_method_from_name ((u_char *)name, len);
+  free (name);
+
+  if (methods == NGX_HTTP_UNKNOWN)
+    scm_misc_error ("ngx-route!", "unknown method ~S", scm_list_1 (method));
+
+  // segments are copied by the trie
+  name = scm_to_locale_stringn (pattern, &len);
+  str.len = len;
+  str.data = (u_char *)name;
+
+  h = ngx_http_guile_route_add (ngx_http_guile_routes_current, methods, &str,
+                                &err);
+  free (name);
+
+  if (h == NULL && err == NGX_CONF_ERROR)
+    scm_memory_error ("ngx-route!");
+
+  if (h == NULL)
+    scm_misc_error ("ngx-route!", "~A: ~S",
+                    scm_list_2 (scm_from_locale_string (err), pattern));
+
+  h->proc = scm_gc_protect_object (proc);
+
+  return SCM_UNSPECIFIED;
+}
+
+/* Local helpers impl */
+
+static ngx_http_guile_route_node_t *
+create_node (ngx_pool_t *pool, u_char *segment, size_t len)
+{
+  ngx_http_guile_route_node_t *node;
+
+  node = ngx_pcalloc (pool, sizeof (ngx_http_guile_route_node_t));
+  if (node == NULL)
+    return NULL;
+
+  if (len)
+    {
+      node->segment.data = ngx_pnalloc (pool, len);
+      if (node->segment.data == NULL)
+        return NULL;
+
+      ngx_memcpy (node->segment.data, segment, len);
+      node->segment.len = len;
+    }
+
+  node->param_sym = SCM_BOOL_F;
+
+  if (ngx_array_init (&node->children, pool, 2,
+                      sizeof (ngx_http_guile_route_node_t *))
+          != NGX_OK
+      || ngx_array_init (&node->handlers, pool, 1,
+                         sizeof (ngx_http_guile_route_handler_t))
+             != NGX_OK)
+    return NULL;
+
+  return node;
+}
+
+static ngx_http_guile_route_node_t *
+child_node (ngx_pool_t *pool, ngx_http_guile_route_node_t *node,
+            u_char *segment, size_t len, char **err)
+{
+  ngx_http_guile_route_node_t **child, **slot, *found;
+  ngx_uint_t pos;
+
+  *err = NGX_CONF_ERROR;
+
+  if (len > 1 && (*segment == ':' || *segment == '*'))
+    {
+      slot = *segment == ':' ? &node->param : &node->wildcard;
+
+      if (*slot == NULL)
+        {
+          *slot = create_node (pool, segment, len);
+          return *slot;
+        }
+
+      if ((*slot)->segment.len != len
+          || ngx_strncmp ((*slot)->segment.data, segment, len) != 0)
+        {
+          *err = "conflicting parameter names";
+          return NULL;
+        }
+
+      return *slot;
+    }
+
+  found = find_child (node, segment, len, &pos);
+  if (found)
+    return found;
+
+  // keep children sorted for find_child
+  if (ngx_array_push (&node->children) == NULL)
+    return NULL;
+
+  child = node->children.elts;
+  ngx_memmove (&child[pos + 1], &child[pos],
+               (node->children.nelts - 1 - pos) * sizeof (*child));
+
+  child[pos] = create_node (pool, segment, len);
+
+  return child[pos];
+}
+
+/* Binary search of the static children, ordered by segment length then
+   bytes. On a miss pos receives the insertion index. */
+static ngx_http_guile_route_node_t *
+find_child (ngx_http_guile_route_node_t *node, u_char *segment, size_t len,
+            ngx_uint_t *pos)
+{
+  ngx_http_guile_route_node_t **child;
+  ngx_uint_t lo, hi, mid;
+  ngx_int_t rc;
+
+  child = node->children.elts;
+  lo = 0;
+  hi = node->children.nelts;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+
+      if (child[mid]->segment.len != len)
+        rc = child[mid]->segment.len < len ? -1 : 1;
+      else
+        rc = ngx_memcmp (child[mid]->segment.data, segment, len);
+
+      if (rc == 0)
+        return child[mid];
+
+      if (rc < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  if (pos)
+    *pos = lo;
+
+  return NULL;
+}
+
+/* p points at the '/' before the next segment, or at last */
+static ngx_int_t
+walk (ngx_http_guile_route_node_t *node, u_char *p, u_char *last,
+      ngx_uint_t method, ngx_http_guile_route_match_t *match)
+{
+  ngx_http_guile_route_node_t *child;
+  ngx_http_guile_route_param_t *param;
+  u_char *end;
+  size_t len;
+
+  if (p == last)
+    return find_handler (node, method, match);
+
+  p++;
+  end = ngx_strlchr (p, last, '/');
+  if (end == NULL)
+    end = last;
+
+  len = end - p;
+
+  child = find_child (node, p, len, NULL);
+  if (child && walk (child, end, last, method, match) == NGX_OK)
+    return NGX_OK;
+
+  if (match->nparams == NGX_HTTP_GUILE_ROUTE_MAX_PARAMS)
+    return NGX_DECLINED;
+
+  param = &match->params[match->nparams];
+
+  if (node->param && len)
+    {
+      param->node = node->param;
+      param->value.data = p;
+      param->value.len = len;
+      match->nparams++;
+
+      if (walk (node->param, end, last, method, match) == NGX_OK)
+        return NGX_OK;
+
+      match->nparams--;
+    }
+
+  if (node->wildcard)
+    {
+      param->node = node->wildcard;
+      param->value.data = p;
+      param->value.len = last - p;
+      match->nparams++;
+
+      if (find_handler (node->wildcard, method, match) == NGX_OK)
+        return NGX_OK;
+
+      match->nparams--;
+    }
+
+  return NGX_DECLINED;
+}
+
+static ngx_int_t
+find_handler (ngx_http_guile_route_node_t *node, ngx_uint_t method,
+              ngx_http_guile_route_match_t *match)
+{
+  ngx_http_guile_route_handler_t *h;
+  ngx_uint_t i;
+
+  h = node->handlers.elts;
+  for (i = 0; i < node->handlers.nelts; i++)
+    {
+      if (h[i].methods == 0 || (h[i].methods & method))
+        {
+          match->handler = &h[i];
+          return NGX_OK;
+        }
+    }
+
+  return NGX_DECLINED;
+}
+
+static void
+routes_cleanup (void *data)
+{
+  // nothing was protected if guile never started, pool cleanups run
+  // outside of guile mode
+  if (scm_initialized_p)
+    scm_with_guile (routes_unprotect, data);
+}
+
+static void *
+routes_unprotect (void *data)
+{
+  ngx_http_guile_routes_t *routes = data;
+
+  unprotect_node (routes->root);
+
+  return NULL;
+}
+
+static void
+unprotect_node (ngx_http_guile_route_node_t *node)
+{
+  ngx_http_guile_route_node_t **child;
+  ngx_http_guile_route_handler_t *h;
+  ngx_uint_t i;
+
+  if (scm_is_true (node->param_sym))
+    scm_gc_unprotect_object (node->param_sym);
+
+  h = node->handlers.elts;
+  for (i = 0; i < node->handlers.nelts; i++)
+    {
+      if (scm_is_true (h[i].proc))
+        scm_gc_unprotect_object (h[i].proc);
+    }
+
+  // a failed configuration may leave an empty slot
+  child = node->children.elts;
+  for (i = 0; i < node->children.nelts; i++)
+    {
+      if (child[i])
+        unprotect_node (child[i]);
+    }
+
+  if (node->param)
+    unprotect_node (node->param);
+
+  if (node->wildcard)
+    unprotect_node (node->wildcard);
+}
@@ -0,0 +1,98 @@
+#ifndef _NGX_HTTP_GUILE_ROUTE_INCLUDED_
+#define _NGX_HTTP_GUILE_ROUTE_INCLUDED_
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+// ngx must be included first
+#include <libguile.h>
+
+#define NGX_HTTP_GUILE_ROUTE_MAX_PARAMS 16
+
+typedef struct ngx_http_guile_route_node_s ngx_http_guile_route_node_t;
+
+/* Procedure bound to a method mask, 0 matches any method. Routes declared
+   by directives hold the procedure name and resolve it on first use. */
+typedef struct
+{
+  ngx_uint_t methods;
+  ngx_str_t name;
+  SCM var;
+  SCM proc;
+} ngx_http_guile_route_handler_t;
+
+/* Trie keyed by path segment. Static children, kept sorted for binary
+   search, are tried first, then the ":param" child, then the "*param" child
+   matching the rest of the path. */
+struct ngx_http_guile_route_node_s
+{
+  ngx_str_t segment;
+  SCM param_sym;
+
+  ngx_array_t children;
+  ngx_http_guile_route_node_t *param;
+  ngx_http_guile_route_node_t *wildcard;
+
+  ngx_array_t handlers;
+};
+
+typedef struct
+{
+  ngx_http_guile_route_node_t *root;
+  ngx_pool_t *pool;
+} ngx_http_guile_routes_t;
+
+typedef struct
+{
+  ngx_http_guile_route_node_t *node;
+  ngx_str_t value;
+} ngx_http_guile_route_param_t;
+
+typedef struct
+{
+  ngx_http_guile_route_handler_t *handler;
+  ngx_uint_t nparams;
+  ngx_http_guile_route_param_t params[NGX_HTTP_GUILE_ROUTE_MAX_PARAMS];
+} ngx_http_guile_route_match_t;
+
+/* Constructors */
+
+ngx_http_guile_routes_t *ngx_http_guile_routes_create (ngx_pool_t *pool);
+
+ngx_http_guile_route_handler_t *
+ngx_http_guile_route_add (ngx_http_guile_routes_t *routes, ngx_uint_t methods,
+                          ngx_str_t *pattern, char **err);
+
+/* Matching */
+
+ngx_int_t ngx_http_guile_route_find (ngx_http_guile_routes_t *routes,
+                                     ngx_http_request_t *r,
+                                     ngx_http_guile_route_match_t *match);
+SCM ngx_http_guile_route_proc (ngx_http_guile_route_handler_t *handler,
+                               SCM module);
+SCM ngx_http_guile_route_params (ngx_http_guile_route_match_t *match);
+
+/* Declaration from Scheme while the init script is loaded */
+
+void ngx_http_guile_route_set_current (ngx_http_guile_routes_t *routes);
+SCM ngx_http_guile_route_define (SCM method, SCM pattern, SCM proc);
+
+#endif /* _NGX_HTTP_GUILE_ROUTE_INCLUDED_ */
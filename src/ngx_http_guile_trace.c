@@ -0,0 +1,522 @@
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include "ngx_http_guile_trace.h"
+#include <time.h>
+
+/* Names of the spans, index 0 collects names past the table */
+#define NGX_HTTP_GUILE_TRACE_NAMES 256
+
+/* A record of the ring, the dump is read on the same host so fields keep
+   the native byte order */
+typedef struct
+{
+  uint64_t time;    /* ns, CLOCK_MONOTONIC */
+  uint32_t request; /* serial of the traced request, 0 for GC */
+  uint16_t type;
+  uint16_t name;
+} ngx_http_guile_trace_record_t;
+
+/* Dump layout: this header, then for each name its uint16_t length and
+   bytes, then the records from the oldest */
+typedef struct
+{
+  u_char magic[8];
+  uint32_t pid;
+  uint32_t names;
+  uint64_t records;
+} ngx_http_guile_trace_header_t;
+
+#define NGX_HTTP_GUILE_TRACE_MAGIC "NGXGTRC1"
+
+ngx_uint_t ngx_http_guile_trace_active;
+
+/* Worker state, the ring is allocated by init_process */
+static ngx_http_guile_trace_record_t *ngx_http_guile_trace_ring;
+static ngx_uint_t ngx_http_guile_trace_size;
+static uint64_t ngx_http_guile_trace_next;
+static ngx_uint_t ngx_http_guile_trace_sample;
+static ngx_uint_t ngx_http_guile_trace_requests;
+static ngx_uint_t ngx_http_guile_trace_serial;
+static ngx_flag_t ngx_http_guile_trace_gc;
+static u_char *ngx_http_guile_trace_dump_path;
+
+static const char *ngx_http_guile_trace_names[NGX_HTTP_GUILE_TRACE_NAMES]
+    = { "other" };
+static ngx_uint_t ngx_http_guile_trace_nnames = 1;
+
+/* symbol -> name index of Scheme spans */
+static SCM ngx_http_guile_trace_span_names;
+
+static ngx_int_t ngx_http_guile_trace_dump_handler (ngx_http_request_t *r);
+static void *ngx_http_guile_trace_gc_begin (void *hook_data, void *fn_data,
+                                            void *data);
+static void *ngx_http_guile_trace_gc_end (void *hook_data, void *fn_data,
+                                          void *data);
+static void *ngx_http_guile_trace_init_scm (void *data);
+static void ngx_http_guile_trace_write (ngx_uint_t type, ngx_uint_t name,
+                                        ngx_uint_t request);
+static ngx_uint_t ngx_http_guile_trace_name (const char *name);
+static ngx_uint_t ngx_http_guile_trace_span_name (SCM name,
+                                                  const char *subr);
+static size_t ngx_http_guile_trace_dump_size ();
+static u_char *ngx_http_guile_trace_dump_copy (u_char *p);
+
+/* Configuration */
+
+/* guile_trace buffer=size [sample=n] [dump=path] | off */
+char *
+ngx_http_guile_trace_conf (ngx_conf_t *cf, ngx_http_guile_trace_conf_t **tcfp)
+{
+  ngx_http_guile_trace_conf_t *tcf;
+  ngx_str_t *value, s;
+  ngx_uint_t i;
+  ngx_int_t n;
+  ssize_t size;
+
+  if (*tcfp != NGX_CONF_UNSET_PTR)
+    return "is duplicate";
+
+  value = cf->args->elts;
+
+  if (cf->args->nelts == 2 && ngx_strcmp (value[1].data, "off") == 0)
+    {
+      *tcfp = NULL;
+      return NGX_CONF_OK;
+    }
+
+  tcf = ngx_pcalloc (cf->pool, sizeof (ngx_http_guile_trace_conf_t));
+  if (tcf == NULL)
+    return NGX_CONF_ERROR;
+
+  tcf->sample = 1;
+
+  for (i = 1; i < cf->args->nelts; i++)
+    {
+      if (ngx_strncmp (value[i].data, "buffer=", 7) == 0)
+        {
+          s.len = value[i].len - 7;
+          s.data = value[i].data + 7;
+
+          size = ngx_parse_size (&s);
+          if (size < (ssize_t)(16 * sizeof (ngx_http_guile_trace_record_t)))
+            goto invalid;
+
+          tcf->size = size;
+          continue;
+        }
+
+      if (ngx_strncmp (value[i].data, "sample=", 7) == 0)
+        {
+          n = ngx_atoi (value[i].data + 7, value[i].len - 7);
+          if (n <= 0)
+            goto invalid;
+
+          tcf->sample = n;
+          continue;
+        }
+
+      if (ngx_strncmp (value[i].data, "dump=", 5) == 0)
+        {
+          tcf->dump.len = value[i].len - 5;
+          tcf->dump.data = value[i].data + 5;
+
+          if (tcf->dump.len == 0
+              || ngx_conf_full_name (cf->cycle, &tcf->dump, 0) != NGX_OK)
+            goto invalid;
+
+          continue;
+        }
+
+    invalid:
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                          &value[i]);
+      return NGX_CONF_ERROR;
+    }
+
+  if (tcf->size == 0)
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                          "\"buffer\" parameter is required");
+      return NGX_CONF_ERROR;
+    }
+
+  *tcfp = tcf;
+
+  return NGX_CONF_OK;
+}
+
+/* guile_trace_dump, serves the ring of the worker handling the request */
+char *
+ngx_http_guile_trace_dump (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_core_loc_conf_t *clcf;
+
+  clcf = ngx_http_conf_get_module_loc_conf (cf, ngx_http_core_module);
+  clcf->handler = ngx_http_guile_trace_dump_handler;
+
+  return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_guile_trace_dump_handler (ngx_http_request_t *r)
+{
+  ngx_chain_t out;
+  ngx_buf_t *b;
+  ngx_int_t rc;
+  size_t len;
+
+  if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
+    return NGX_HTTP_NOT_ALLOWED;
+
+  rc = ngx_http_discard_request_body (r);
+  if (rc != NGX_OK)
+    return rc;
+
+  if (ngx_http_guile_trace_ring == NULL)
+    return NGX_HTTP_NOT_FOUND;
+
+  len = ngx_http_guile_trace_dump_size ();
+
+  b = ngx_create_temp_buf (r->pool, len);
+  if (b == NULL)
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  b->last = ngx_http_guile_trace_dump_copy (b->pos);
+  b->last_buf = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = len;
+  ngx_str_set (&r->headers_out.content_type, "application/octet-stream");
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+  rc = ngx_http_send_header (r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+    return rc;
+
+  out.buf = b;
+  out.next = NULL;
+
+  return ngx_http_output_filter (r, &out);
+}
+
+/* Worker */
+
+ngx_int_t
+ngx_http_guile_trace_init_process (ngx_http_guile_trace_conf_t *tcf,
+                                   ngx_cycle_t *cycle)
+{
+  ngx_http_guile_trace_size
+      = tcf->size / sizeof (ngx_http_guile_trace_record_t);
+
+  ngx_http_guile_trace_ring = ngx_alloc (
+      ngx_http_guile_trace_size * sizeof (ngx_http_guile_trace_record_t),
+      cycle->log);
+  if (ngx_http_guile_trace_ring == NULL)
+    return NGX_ERROR;
+
+  ngx_http_guile_trace_sample = tcf->sample;
+  ngx_http_guile_trace_dump_path = tcf->dump.data;
+
+  scm_with_guile (ngx_http_guile_trace_init_scm, NULL);
+
+  return NGX_OK;
+}
+
+static void *
+ngx_http_guile_trace_init_scm (void *data)
+{
+  ngx_http_guile_trace_span_names
+      = scm_gc_protect_object (scm_c_make_hash_table (64));
+
+  // the before hook runs within the collector, it must not allocate
+  scm_c_hook_add (&scm_before_gc_c_hook, ngx_http_guile_trace_gc_begin, NULL,
+                  0);
+  scm_c_hook_add (&scm_after_gc_c_hook, ngx_http_guile_trace_gc_end, NULL, 0);
+
+  return NULL;
+}
+
+/* Write the ring to dump.<pid> when the worker exits, e.g. on reload */
+void
+ngx_http_guile_trace_exit_process (ngx_cycle_t *cycle)
+{
+  u_char *name, *buf;
+  ngx_fd_t fd;
+  size_t len;
+  ssize_t n;
+
+  if (ngx_http_guile_trace_ring == NULL
+      || ngx_http_guile_trace_dump_path == NULL)
+    return;
+
+  len = ngx_http_guile_trace_dump_size ();
+
+  name = ngx_alloc (ngx_strlen (ngx_http_guile_trace_dump_path)
+                        + 1 + NGX_INT64_LEN + 1,
+                    cycle->log);
+  buf = ngx_alloc (len, cycle->log);
+
+  if (name == NULL || buf == NULL)
+    goto done;
+
+  ngx_sprintf (name, "%s.%P%Z", ngx_http_guile_trace_dump_path, ngx_pid);
+  ngx_http_guile_trace_dump_copy (buf);
+
+  fd = ngx_open_file (name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                      NGX_FILE_DEFAULT_ACCESS);
+  if (fd == NGX_INVALID_FILE)
+    {
+      ngx_log_error (NGX_LOG_ALERT, cycle->log, ngx_errno,
+                     ngx_open_file_n " \"%s\" failed", name);
+      goto done;
+    }
+
+  n = ngx_write_fd (fd, buf, len);
+  if (n != (ssize_t)len)
+    ngx_log_error (NGX_LOG_ALERT, cycle->log, ngx_errno,
+                   ngx_write_fd_n " to \"%s\" failed", name);
+
+  if (ngx_close_file (fd) == NGX_FILE_ERROR)
+    ngx_log_error (NGX_LOG_ALERT, cycle->log, ngx_errno,
+                   ngx_close_file_n " \"%s\" failed", name);
+
+done:
+
+  if (name)
+    ngx_free (name);
+
+  if (buf)
+    ngx_free (buf);
+}
+
+/* Recording */
+
+/* Sample the request about to enter Scheme */
+void
+ngx_http_guile_trace_request_begin ()
+{
+  if (ngx_http_guile_trace_ring == NULL)
+    return;
+
+  if (ngx_http_guile_trace_requests++ % ngx_http_guile_trace_sample)
+    return;
+
+  // 0 is for records outside of requests
+  if (++ngx_http_guile_trace_serial > NGX_MAX_UINT32_VALUE)
+    ngx_http_guile_trace_serial = 1;
+
+  ngx_http_guile_trace_active = ngx_http_guile_trace_serial;
+
+  ngx_http_guile_trace_record (NGX_HTTP_GUILE_TRACE_BEGIN, "handler");
+}
+
+void
+ngx_http_guile_trace_request_end ()
+{
+  if (!ngx_http_guile_trace_active)
+    return;
+
+  ngx_http_guile_trace_record (NGX_HTTP_GUILE_TRACE_END, "handler");
+
+  ngx_http_guile_trace_active = 0;
+}
+
+/* name is a static string, e.g. __func__, told apart by its address */
+void
+ngx_http_guile_trace_record (ngx_uint_t type, const char *name)
+{
+  ngx_http_guile_trace_write (type, ngx_http_guile_trace_name (name),
+                              ngx_http_guile_trace_active);
+}
+
+/* Collections are recorded while a sampled request runs, so that sampling
+   bounds the records written */
+static void *
+ngx_http_guile_trace_gc_begin (void *hook_data, void *fn_data, void *data)
+{
+  if (!ngx_http_guile_trace_active)
+    return NULL;
+
+  ngx_http_guile_trace_gc = 1;
+
+  ngx_http_guile_trace_write (NGX_HTTP_GUILE_TRACE_BEGIN,
+                              ngx_http_guile_trace_name ("gc"), 0);
+  return NULL;
+}
+
+/* Runs as an async, the end of a collection is seen when the worker next
+   polls asyncs, possibly after the request */
+static void *
+ngx_http_guile_trace_gc_end (void *hook_data, void *fn_data, void *data)
+{
+  if (!ngx_http_guile_trace_gc)
+    return NULL;
+
+  ngx_http_guile_trace_gc = 0;
+
+  ngx_http_guile_trace_write (NGX_HTTP_GUILE_TRACE_END,
+                              ngx_http_guile_trace_name ("gc"), 0);
+  return NULL;
+}
+
+static void
+ngx_http_guile_trace_write (ngx_uint_t type, ngx_uint_t name,
+                            ngx_uint_t request)
+{
+  ngx_http_guile_trace_record_t *rec;
+  struct timespec ts;
+
+  rec = &ngx_http_guile_trace_ring[ngx_http_guile_trace_next++
+                                   % ngx_http_guile_trace_size];
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  rec->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  rec->request = (uint32_t)request;
+  rec->type = (uint16_t)type;
+  rec->name = (uint16_t)name;
+}
+
+static ngx_uint_t
+ngx_http_guile_trace_name (const char *name)
+{
+  ngx_uint_t i;
+
+  for (i = 1; i < ngx_http_guile_trace_nnames; i++)
+    {
+      if (ngx_http_guile_trace_names[i] == name)
+        return i;
+    }
+
+  if (ngx_http_guile_trace_nnames == NGX_HTTP_GUILE_TRACE_NAMES)
+    return 0;
+
+  ngx_http_guile_trace_names[ngx_http_guile_trace_nnames] = name;
+
+  return ngx_http_guile_trace_nnames++;
+}
+
+/* Scheme spans are named by symbols, their C names are kept for the life
+   of the worker */
+static ngx_uint_t
+ngx_http_guile_trace_span_name (SCM name, const char *subr)
+{
+  SCM index;
+  char *s;
+
+  SCM_ASSERT (scm_is_symbol (name), name, SCM_ARG1, subr);
+
+  index = scm_hashq_ref (ngx_http_guile_trace_span_names, name, SCM_BOOL_F);
+  if (scm_is_true (index))
+    return scm_to_uint (index);
+
+  if (ngx_http_guile_trace_nnames == NGX_HTTP_GUILE_TRACE_NAMES)
+    return 0;
+
+  s = scm_to_utf8_string (scm_symbol_to_string (name));
+
+  index = scm_from_uint (ngx_http_guile_trace_name (s));
+  scm_hashq_set_x (ngx_http_guile_trace_span_names, name, index);
+
+  return scm_to_uint (index);
+}
+
+/* Dump */
+
+static size_t
+ngx_http_guile_trace_dump_size ()
+{
+  size_t len;
+  ngx_uint_t i;
+
+  len = sizeof (ngx_http_guile_trace_header_t);
+
+  for (i = 0; i < ngx_http_guile_trace_nnames; i++)
+    len += sizeof (uint16_t) + ngx_strlen (ngx_http_guile_trace_names[i]);
+
+  len += ngx_min (ngx_http_guile_trace_next, ngx_http_guile_trace_size)
+         * sizeof (ngx_http_guile_trace_record_t);
+
+  return len;
+}
+
+static u_char *
+ngx_http_guile_trace_dump_copy (u_char *p)
+{
+  ngx_http_guile_trace_header_t header;
+  ngx_uint_t i, start, n;
+  uint16_t len;
+
+  n = ngx_min (ngx_http_guile_trace_next, ngx_http_guile_trace_size);
+  start = ngx_http_guile_trace_next > ngx_http_guile_trace_size
+              ? ngx_http_guile_trace_next % ngx_http_guile_trace_size
+              : 0;
+
+  ngx_memcpy (header.magic, NGX_HTTP_GUILE_TRACE_MAGIC, 8);
+  header.pid = (uint32_t)ngx_pid;
+  header.names = (uint32_t)ngx_http_guile_trace_nnames;
+  header.records = n;
+
+  p = ngx_cpymem (p, &header, sizeof (ngx_http_guile_trace_header_t));
+
+  for (i = 0; i < ngx_http_guile_trace_nnames; i++)
+    {
+      len = (uint16_t)ngx_strlen (ngx_http_guile_trace_names[i]);
+      p = ngx_cpymem (p, &len, sizeof (uint16_t));
+      p = ngx_cpymem (p, ngx_http_guile_trace_names[i], len);
+    }
+
+  // oldest records first, the ring may have wrapped
+  p = ngx_cpymem (p, &ngx_http_guile_trace_ring[start],
+                  (n - start) * sizeof (ngx_http_guile_trace_record_t));
+  p = ngx_cpymem (p, ngx_http_guile_trace_ring,
+                  start * sizeof (ngx_http_guile_trace_record_t));
+
+  return p;
+}
+
+/* Scheme */
+
+/* (ngx-trace-begin 'name) and (ngx-trace-end 'name) delimit a span of the
+   traced request, they do nothing when the request is not sampled */
+SCM
+ngx_http_guile_trace_begin (SCM name)
+{
+  if (ngx_http_guile_trace_active)
+    ngx_http_guile_trace_write (NGX_HTTP_GUILE_TRACE_BEGIN,
+                                ngx_http_guile_trace_span_name (
+                                    name, "ngx-trace-begin"),
+                                ngx_http_guile_trace_active);
+
+  return SCM_UNSPECIFIED;
+}
+
+SCM
+ngx_http_guile_trace_end (SCM name)
+{
+  if (ngx_http_guile_trace_active)
+    ngx_http_guile_trace_write (NGX_HTTP_GUILE_TRACE_END,
+                                ngx_http_guile_trace_span_name (
+                                    name, "ngx-trace-end"),
+                                ngx_http_guile_trace_active);
+
+  return SCM_UNSPECIFIED;
+}
@@ -0,0 +1,75 @@
+#ifndef _NGX_HTTP_GUILE_TRACE_INCLUDED_
+#define _NGX_HTTP_GUILE_TRACE_INCLUDED_
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+// ngx must be included first
+#include <libguile.h>
+
+#define NGX_HTTP_GUILE_TRACE_BEGIN 1
+#define NGX_HTTP_GUILE_TRACE_END 2
+#define NGX_HTTP_GUILE_TRACE_INSTANT 3
+
+typedef struct
+{
+  size_t size;
+  ngx_uint_t sample;
+  ngx_str_t dump;
+} ngx_http_guile_trace_conf_t;
+
+/* Serial of the request being traced, 0 when the current request is not
+   sampled */
+extern ngx_uint_t ngx_http_guile_trace_active;
+
+#define ngx_http_guile_trace(type, name)                                      \
+  do                                                                          \
+    {                                                                         \
+      if (ngx_http_guile_trace_active)                                        \
+        ngx_http_guile_trace_record (type, name);                             \
+    }                                                                         \
+  while (0)
+
+/* Configuration */
+
+char *ngx_http_guile_trace_conf (ngx_conf_t *cf,
+                                 ngx_http_guile_trace_conf_t **tcfp);
+char *ngx_http_guile_trace_dump (ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf);
+
+/* Worker */
+
+ngx_int_t ngx_http_guile_trace_init_process (ngx_http_guile_trace_conf_t *tcf,
+                                             ngx_cycle_t *cycle);
+void ngx_http_guile_trace_exit_process (ngx_cycle_t *cycle);
+
+/* Recording */
+
+void ngx_http_guile_trace_request_begin ();
+void ngx_http_guile_trace_request_end ();
+void ngx_http_guile_trace_record (ngx_uint_t type, const char *name);
+
+/* Scheme */
+
+SCM ngx_http_guile_trace_begin (SCM name);
+SCM ngx_http_guile_trace_end (SCM name);
+
+#endif /* _NGX_HTTP_GUILE_TRACE_INCLUDED_ */
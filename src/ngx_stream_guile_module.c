@@ -0,0 +1,816 @@
+/* Guile NGINX Module
+ * Copyright (C) 2023-2024 Tommaso Rossi
+ *
+ * This file is part of Guile NGINX Module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+// has to be included after ngx
+#include <libguile.h>
+
+#include "ngx_guile_string.h"
+
+#define NGX_STREAM_GUILE_MODULE "ngx stream base"
+
+/* Scheme procedure named in a directive, resolved once the configuration
+   is read */
+typedef struct
+{
+  ngx_str_t name;
+  SCM var;
+} ngx_stream_guile_proc_t;
+
+typedef struct
+{
+  ngx_str_t init_script;
+
+  /* of ngx_stream_guile_proc_t *, every procedure named in directives */
+  ngx_array_t procs;
+} ngx_stream_guile_main_conf_t;
+
+typedef struct
+{
+  ngx_stream_guile_proc_t *preread;
+  ngx_stream_guile_proc_t *access;
+} ngx_stream_guile_srv_conf_t;
+
+/* Embed nginx stream session into guile */
+typedef struct
+{
+  ngx_stream_session_t *session;
+} ngx_stream_guile_session_t;
+
+typedef struct
+{
+  SCM session;
+
+  /* of ngx_stream_guile_value_buf_t, NULL until a variable is set */
+  ngx_array_t *values;
+} ngx_stream_guile_ctx_t;
+
+/* Storage of a guile_set variable, reused when the variable is evaluated
+   again in the same session */
+typedef struct
+{
+  ngx_stream_guile_proc_t *proc;
+  u_char *data;
+  size_t size;
+} ngx_stream_guile_value_buf_t;
+
+/* A call into Scheme from a phase handler, or from a variable handler when
+   value is set */
+typedef struct
+{
+  ngx_stream_session_t *session;
+  ngx_stream_guile_proc_t *proc;
+  ngx_stream_variable_value_t *value;
+  ngx_flag_t preread;
+  ngx_int_t rc;
+} ngx_stream_guile_call_t;
+
+static void *ngx_stream_guile_create_main_conf (ngx_conf_t *cf);
+static void *ngx_stream_guile_create_srv_conf (ngx_conf_t *cf);
+static char *ngx_stream_guile_merge_srv_conf (ngx_conf_t *cf, void *parent,
+                                              void *child);
+static ngx_int_t ngx_stream_guile_init (ngx_conf_t *cf);
+static char *ngx_stream_guile_init_script (ngx_conf_t *cf, ngx_command_t *cmd,
+                                           void *conf);
+static char *ngx_stream_guile_set_proc (ngx_conf_t *cf, ngx_command_t *cmd,
+                                        void *conf);
+static char *ngx_stream_guile_set (ngx_conf_t *cf, ngx_command_t *cmd,
+                                   void *conf);
+static ngx_stream_guile_proc_t *ngx_stream_guile_proc (ngx_conf_t *cf,
+                                                       ngx_str_t *name);
+
+static ngx_int_t ngx_stream_guile_preread_handler (ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_guile_access_handler (ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_guile_variable (ngx_stream_session_t *s,
+                                            ngx_stream_variable_value_t *v,
+                                            uintptr_t data);
+static void *ngx_stream_guile_call_scm (void *data);
+static SCM ngx_stream_guile_call_body (void *data);
+static SCM ngx_stream_guile_call_error (void *data, SCM key, SCM args);
+static ngx_int_t ngx_stream_guile_rc (SCM result, ngx_flag_t preread);
+static ngx_int_t ngx_stream_guile_value (ngx_stream_session_t *s,
+                                         ngx_stream_guile_ctx_t *ctx,
+                                         ngx_stream_guile_call_t *call,
+                                         SCM result);
+static void *ngx_stream_guile_resolve_scm (void *data);
+
+static void *ngx_stream_guile_init_scm (void *data);
+static void ngx_stream_guile_init_module (void *data);
+static ngx_stream_guile_ctx_t *ngx_stream_guile_get_ctx (
+    ngx_stream_session_t *s);
+static void ngx_stream_guile_ctx_cleanup (void *data);
+static void *ngx_stream_guile_ctx_unprotect (void *data);
+
+static ngx_stream_session_t *unwrap_session (SCM session);
+
+static SCM ngx_stream_guile_session_preread (SCM session);
+static SCM ngx_stream_guile_session_remote_addr (SCM session);
+static SCM ngx_stream_guile_session_protocol (SCM session);
+static SCM ngx_stream_guile_session_received (SCM session);
+static SCM ngx_stream_guile_session_variable (SCM session, SCM name);
+
+static SCM ngx_stream_guile_session_scm;
+static SCM ngx_stream_guile_sym_again;
+static SCM ngx_stream_guile_sym_ok;
+static SCM ngx_stream_guile_sym_tcp;
+static SCM ngx_stream_guile_sym_udp;
+
+static ngx_command_t ngx_stream_guile_commands[] = {
+
+  { ngx_string ("guile_init_script"), NGX_STREAM_MAIN_CONF | NGX_CONF_TAKE1,
+    ngx_stream_guile_init_script, NGX_STREAM_MAIN_CONF_OFFSET, 0, NULL },
+
+  { ngx_string ("guile_preread"), NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF
+                                      | NGX_CONF_TAKE1,
+    ngx_stream_guile_set_proc, NGX_STREAM_SRV_CONF_OFFSET,
+    offsetof (ngx_stream_guile_srv_conf_t, preread), NULL },
+
+  { ngx_string ("guile_access"), NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF
+                                     | NGX_CONF_TAKE1,
+    ngx_stream_guile_set_proc, NGX_STREAM_SRV_CONF_OFFSET,
+    offsetof (ngx_stream_guile_srv_conf_t, access), NULL },
+
+  { ngx_string ("guile_set"), NGX_STREAM_MAIN_CONF | NGX_CONF_TAKE2,
+    ngx_stream_guile_set, 0, 0, NULL },
+
+  ngx_null_command
+};
+
+static ngx_stream_module_t ngx_stream_guile_module_ctx = {
+  NULL,                  /* preconfiguration */
+  ngx_stream_guile_init, /* postconfiguration */
+
+  ngx_stream_guile_create_main_conf, /* create main configuration */
+  NULL,                              /* init main configuration */
+
+  ngx_stream_guile_create_srv_conf, /* create server configuration */
+  ngx_stream_guile_merge_srv_conf   /* merge server configuration */
+};
+
+ngx_module_t ngx_stream_guile_module
+    = { NGX_MODULE_V1,
+        &ngx_stream_guile_module_ctx, /* module context */
+        ngx_stream_guile_commands,    /* module directives */
+        NGX_STREAM_MODULE,            /* module type */
+        NULL,                         /* init master */
+        NULL,                         /* init module */
+        NULL,                         /* init process */
+        NULL,                         /* init thread */
+        NULL,                         /* exit thread */
+        NULL,                         /* exit process */
+        NULL,                         /* exit master */
+        NGX_MODULE_V1_PADDING };
+
+/* Phase handlers */
+
+static ngx_int_t
+ngx_stream_guile_preread_handler (ngx_stream_session_t *s)
+{
+  ngx_stream_guile_srv_conf_t *gscf;
+  ngx_stream_guile_call_t call;
+
+  gscf = ngx_stream_get_module_srv_conf (s, ngx_stream_guile_module);
+  if (gscf->preread == NULL)
+    return NGX_DECLINED;
+
+  ngx_memzero (&call, sizeof (ngx_stream_guile_call_t));
+  call.session = s;
+  call.proc = gscf->preread;
+  call.preread = 1;
+
+  scm_with_guile (ngx_stream_guile_call_scm, &call);
+
+  return call.rc;
+}
+
+static ngx_int_t
+ngx_stream_guile_access_handler (ngx_stream_session_t *s)
+{
+  ngx_stream_guile_srv_conf_t *gscf;
+  ngx_stream_guile_call_t call;
+
+  gscf = ngx_stream_get_module_srv_conf (s, ngx_stream_guile_module);
+  if (gscf->access == NULL)
+    return NGX_DECLINED;
+
+  ngx_memzero (&call, sizeof (ngx_stream_guile_call_t));
+  call.session = s;
+  call.proc = gscf->access;
+
+  scm_with_guile (ngx_stream_guile_call_scm, &call);
+
+  return call.rc;
+}
+
+static ngx_int_t
+ngx_stream_guile_variable (ngx_stream_session_t *s,
+                           ngx_stream_variable_value_t *v, uintptr_t data)
+{
+  ngx_stream_guile_call_t call;
+
+  ngx_memzero (&call, sizeof (ngx_stream_guile_call_t));
+  call.session = s;
+  call.proc = (ngx_stream_guile_proc_t *)data;
+  call.value = v;
+
+  scm_with_guile (ngx_stream_guile_call_scm, &call);
+
+  return call.rc;
+}
+
+/* Map the value returned by a Scheme hook to a phase handler code:
+   #t or unspecified continue, 'ok skips the rest of the phase, 'again waits
+   for more data in preread, #f forbids and a status code between 200 and
+   599 finalizes the session with that status. Other integers are an
+   error. */
+static ngx_int_t
+ngx_stream_guile_rc (SCM result, ngx_flag_t preread)
+{
+  if (scm_is_false (result))
+    return NGX_STREAM_FORBIDDEN;
+
+  if (scm_is_integer (result))
+    return (ngx_int_t)scm_to_signed_integer (result, NGX_STREAM_OK, 599);
+
+  if (scm_is_eq (result, ngx_stream_guile_sym_ok))
+    return NGX_OK;
+
+  if (preread && scm_is_eq (result, ngx_stream_guile_sym_again))
+    return NGX_AGAIN;
+
+  return NGX_DECLINED;
+}
+
+/* Strings become the variable value, anything else leaves it not found.
+   The storage of the variable is reused, it only grows when a longer
+   value is set. */
+static ngx_int_t
+ngx_stream_guile_value (ngx_stream_session_t *s, ngx_stream_guile_ctx_t *ctx,
+                        ngx_stream_guile_call_t *call, SCM result)
+{
+  ngx_stream_variable_value_t *v = call->value;
+  ngx_stream_guile_value_buf_t *buf;
+  ngx_uint_t i;
+  size_t len;
+  char *str;
+
+  if (!scm_is_string (result))
+    {
+      v->not_found = 1;
+      return NGX_OK;
+    }
+
+  if (ctx->values == NULL)
+    {
+      ctx->values = ngx_array_create (s->connection->pool, 2,
+                                      sizeof (ngx_stream_guile_value_buf_t));
+      if (ctx->values == NULL)
+        return NGX_ERROR;
+    }
+
+  buf = ctx->values->elts;
+
+  for (i = 0; i < ctx->values->nelts; i++)
+    {
+      if (buf[i].proc == call->proc)
+        break;
+    }
+
+  if (i == ctx->values->nelts)
+    {
+      buf = ngx_array_push (ctx->values);
+      if (buf == NULL)
+        return NGX_ERROR;
+
+      buf->proc = call->proc;
+      buf->data = NULL;
+      buf->size = 0;
+    }
+  else
+    buf = &buf[i];
+
+  str = scm_to_locale_stringn (result, &len);
+
+  if (len > buf->size)
+    {
+      buf->size = ngx_max (len, 2 * buf->size);
+      buf->data = ngx_pnalloc (s->connection->pool, buf->size);
+      if (buf->data == NULL)
+        {
+          free (str);
+          return NGX_ERROR;
+        }
+    }
+
+  ngx_memcpy (buf->data, str, len);
+  free (str);
+
+  v->data = buf->data;
+  v->len = len;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+
+  return NGX_OK;
+}
+
+/* Calling into Scheme */
+
+/* rc keeps the error code unless the call completes, errors are logged
+   by the catch handler */
+static void *
+ngx_stream_guile_call_scm (void *data)
+{
+  ngx_stream_guile_call_t *call = data;
+
+  call->rc = call->value ? NGX_ERROR : NGX_STREAM_INTERNAL_SERVER_ERROR;
+
+  scm_c_catch (SCM_BOOL_T, ngx_stream_guile_call_body, call,
+               ngx_stream_guile_call_error, call->session, NULL, NULL);
+
+  return NULL;
+}
+
+/* The result is converted here, so that an invalid one is reported like
+   any other Scheme error */
+static SCM
+ngx_stream_guile_call_body (void *data)
+{
+  ngx_stream_guile_call_t *call = data;
+  ngx_stream_guile_ctx_t *ctx;
+  SCM result;
+
+  ctx = ngx_stream_guile_get_ctx (call->session);
+  if (ctx == NULL)
+    return SCM_UNSPECIFIED;
+
+  result = scm_call_1 (scm_variable_ref (call->proc->var), ctx->session);
+
+  if (call->value)
+    call->rc = ngx_stream_guile_value (call->session, ctx, call, result);
+  else
+    call->rc = ngx_stream_guile_rc (result, call->preread);
+
+  return SCM_UNSPECIFIED;
+}
+
+static SCM
+ngx_stream_guile_call_error (void *data, SCM key, SCM args)
+{
+  ngx_stream_session_t *s = data;
+  char *msg;
+
+  msg = scm_to_locale_string (scm_object_to_string (scm_cons (key, args),
+                                                    SCM_UNDEFINED));
+
+  ngx_log_error (NGX_LOG_ERR, s->connection->log, 0, "guile error: %s", msg);
+
+  free (msg);
+
+  return SCM_UNDEFINED;
+}
+
+/* Session context, protected until the connection pool is destroyed */
+
+static ngx_stream_guile_ctx_t *
+ngx_stream_guile_get_ctx (ngx_stream_session_t *s)
+{
+  ngx_stream_guile_ctx_t *ctx;
+  ngx_stream_guile_session_t *sess;
+  ngx_pool_cleanup_t *cln;
+
+  ctx = ngx_stream_get_module_ctx (s, ngx_stream_guile_module);
+  if (ctx != NULL)
+    return ctx;
+
+  ctx = ngx_pcalloc (s->connection->pool, sizeof (ngx_stream_guile_ctx_t));
+  if (ctx == NULL)
+    return NULL;
+
+  cln = ngx_pool_cleanup_add (s->connection->pool, 0);
+  if (cln == NULL)
+    return NULL;
+
+  sess = scm_gc_malloc (sizeof (ngx_stream_guile_session_t),
+                        "ngx-stream-session");
+  sess->session = s;
+
+  ctx->session = scm_gc_protect_object (
+      scm_make_foreign_object_1 (ngx_stream_guile_session_scm, sess));
+
+  cln->handler = ngx_stream_guile_ctx_cleanup;
+  cln->data = ctx;
+
+  ngx_stream_set_ctx (s, ctx, ngx_stream_guile_module);
+
+  return ctx;
+}
+
+static void
+ngx_stream_guile_ctx_cleanup (void *data)
+{
+  scm_with_guile (ngx_stream_guile_ctx_unprotect, data);
+}
+
+static void *
+ngx_stream_guile_ctx_unprotect (void *data)
+{
+  ngx_stream_guile_ctx_t *ctx = data;
+  ngx_stream_guile_session_t *sess;
+
+  sess = scm_foreign_object_ref (ctx->session, 0);
+  sess->session = NULL;
+
+  scm_gc_unprotect_object (ctx->session);
+
+  return NULL;
+}
+
+/* Accessors */
+
+/* Bytes read so far by the preread phase. The bytevector is a view of the
+   connection buffer, it is not copied and must not be kept after the
+   call returns. */
+static SCM
+ngx_stream_guile_session_preread (SCM session)
+{
+  ngx_stream_session_t *s = unwrap_session (session);
+  ngx_buf_t *b = s->connection->buffer;
+
+  if (b == NULL || b->last == b->pos)
+    return scm_c_make_bytevector (0);
+
+  return scm_pointer_to_bytevector (scm_from_pointer (b->pos, NULL),
+                                    scm_from_size_t (b->last - b->pos),
+                                    SCM_UNDEFINED, SCM_UNDEFINED);
+}
+
+static SCM
+ngx_stream_guile_session_remote_addr (SCM session)
+{
+  ngx_stream_session_t *s = unwrap_session (session);
+
+  return scm_from_ngx_string (s->connection->addr_text);
+}
+
+static SCM
+ngx_stream_guile_session_protocol (SCM session)
+{
+  ngx_stream_session_t *s = unwrap_session (session);
+
+  return s->connection->type == SOCK_DGRAM ? ngx_stream_guile_sym_udp
+                                           : ngx_stream_guile_sym_tcp;
+}
+
+static SCM
+ngx_stream_guile_session_received (SCM session)
+{
+  ngx_stream_session_t *s = unwrap_session (session);
+
+  return scm_from_int64 (s->received);
+}
+
+/* Any stream variable, e.g. "ssl_preread_server_name" for SNI routing */
+static SCM
+ngx_stream_guile_session_variable (SCM session, SCM name)
+{
+  ngx_stream_session_t *s = unwrap_session (session);
+  ngx_stream_variable_value_t *vv;
+  ngx_str_t var;
+  ngx_uint_t key;
+  char *str;
+  size_t len;
+
+  str = scm_to_locale_stringn (name, &len);
+
+  var.len = len;
+  var.data = ngx_pnalloc (s->connection->pool, len);
+  if (var.data == NULL)
+    {
+      free (str);
+      return SCM_BOOL_F;
+    }
+
+  key = ngx_hash_strlow (var.data, (u_char *)str, len);
+  free (str);
+
+  vv = ngx_stream_get_variable (s, &var, key);
+  if (vv == NULL || vv->not_found)
+    return SCM_BOOL_F;
+
+  return scm_from_locale_stringn ((char *)vv->data, vv->len);
+}
+
+/* Configuration */
+
+static void *
+ngx_stream_guile_create_main_conf (ngx_conf_t *cf)
+{
+  ngx_stream_guile_main_conf_t *conf;
+
+  conf = ngx_pcalloc (cf->pool, sizeof (ngx_stream_guile_main_conf_t));
+  if (conf == NULL)
+    return NULL;
+
+  /*
+   * set by ngx_pcalloc():
+   *
+   *     conf->init_script = { 0, NULL };
+   */
+
+  if (ngx_array_init (&conf->procs, cf->pool, 4,
+                      sizeof (ngx_stream_guile_proc_t *))
+      != NGX_OK)
+    return NULL;
+
+  return conf;
+}
+
+static void *
+ngx_stream_guile_create_srv_conf (ngx_conf_t *cf)
+{
+  ngx_stream_guile_srv_conf_t *conf;
+
+  conf = ngx_pcalloc (cf->pool, sizeof (ngx_stream_guile_srv_conf_t));
+  if (conf == NULL)
+    return NULL;
+
+  conf->preread = NGX_CONF_UNSET_PTR;
+  conf->access = NGX_CONF_UNSET_PTR;
+
+  return conf;
+}
+
+static char *
+ngx_stream_guile_merge_srv_conf (ngx_conf_t *cf, void *parent, void *child)
+{
+  ngx_stream_guile_srv_conf_t *prev = parent;
+  ngx_stream_guile_srv_conf_t *conf = child;
+
+  ngx_conf_merge_ptr_value (conf->preread, prev->preread, NULL);
+  ngx_conf_merge_ptr_value (conf->access, prev->access, NULL);
+
+  return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_stream_guile_init (ngx_conf_t *cf)
+{
+  ngx_stream_handler_pt *h;
+  ngx_stream_core_main_conf_t *cmcf;
+  ngx_stream_guile_main_conf_t *gmcf;
+  ngx_stream_guile_proc_t **proc;
+  ngx_uint_t i;
+
+  gmcf = ngx_stream_conf_get_module_main_conf (cf, ngx_stream_guile_module);
+
+  // resolve procedures once, a misspelled name fails the configuration
+  if (gmcf->procs.nelts)
+    {
+      if (gmcf->init_script.data == NULL)
+        {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "guile procedures need \"guile_init_script\"");
+          return NGX_ERROR;
+        }
+
+      scm_with_guile (ngx_stream_guile_resolve_scm, &gmcf->procs);
+
+      proc = gmcf->procs.elts;
+
+      for (i = 0; i < gmcf->procs.nelts; i++)
+        {
+          if (scm_is_false (proc[i]->var))
+            {
+              ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                                  "guile procedure \"%V\" is not defined",
+                                  &proc[i]->name);
+              return NGX_ERROR;
+            }
+        }
+    }
+
+  cmcf = ngx_stream_conf_get_module_main_conf (cf, ngx_stream_core_module);
+
+  // register handlers
+  h = ngx_array_push (&cmcf->phases[NGX_STREAM_PREREAD_PHASE].handlers);
+  if (h == NULL)
+    return NGX_ERROR;
+
+  *h = ngx_stream_guile_preread_handler;
+
+  h = ngx_array_push (&cmcf->phases[NGX_STREAM_ACCESS_PHASE].handlers);
+  if (h == NULL)
+    return NGX_ERROR;
+
+  *h = ngx_stream_guile_access_handler;
+
+  return NGX_OK;
+}
+
+static void *
+ngx_stream_guile_resolve_scm (void *data)
+{
+  ngx_array_t *procs = data;
+  ngx_stream_guile_proc_t **proc;
+  ngx_uint_t i;
+  SCM module;
+
+  module = scm_c_resolve_module (NGX_STREAM_GUILE_MODULE);
+  proc = procs->elts;
+
+  for (i = 0; i < procs->nelts; i++)
+    proc[i]->var = scm_module_variable (
+        module, scm_from_utf8_symbol ((char *)proc[i]->name.data));
+
+  return NULL;
+}
+
+static ngx_stream_guile_proc_t *
+ngx_stream_guile_proc (ngx_conf_t *cf, ngx_str_t *name)
+{
+  ngx_stream_guile_main_conf_t *gmcf;
+  ngx_stream_guile_proc_t *proc, **p;
+
+  gmcf = ngx_stream_conf_get_module_main_conf (cf, ngx_stream_guile_module);
+
+  proc = ngx_palloc (cf->pool, sizeof (ngx_stream_guile_proc_t));
+  if (proc == NULL)
+    return NULL;
+
+  p = ngx_array_push (&gmcf->procs);
+  if (p == NULL)
+    return NULL;
+
+  *p = proc;
+
+  // zero terminated, it is interned as a symbol
+  proc->name.len = name->len;
+  proc->name.data = ngx_pnalloc (cf->pool, name->len + 1);
+  if (proc->name.data == NULL)
+    return NULL;
+
+  *ngx_cpymem (proc->name.data, name->data, name->len) = '\0';
+
+  proc->var = SCM_BOOL_F;
+
+  return proc;
+}
+
+static char *
+ngx_stream_guile_set_proc (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_stream_guile_proc_t **proc;
+  ngx_str_t *value;
+
+  proc = (ngx_stream_guile_proc_t **)((char *)conf + cmd->offset);
+
+  if (*proc != NGX_CONF_UNSET_PTR)
+    return "is duplicate";
+
+  value = cf->args->elts;
+
+  *proc = ngx_stream_guile_proc (cf, &value[1]);
+  if (*proc == NULL)
+    return NGX_CONF_ERROR;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_stream_guile_set (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_stream_variable_t *v;
+  ngx_stream_guile_proc_t *proc;
+  ngx_str_t *value;
+
+  value = cf->args->elts;
+
+  if (value[1].data[0] != '$')
+    {
+      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "invalid variable name \"%V\"",
+                          &value[1]);
+      return NGX_CONF_ERROR;
+    }
+
+  value[1].len--;
+  value[1].data++;
+
+  v = ngx_stream_add_variable (cf, &value[1], NGX_STREAM_VAR_CHANGEABLE);
+  if (v == NULL)
+    return NGX_CONF_ERROR;
+
+  proc = ngx_stream_guile_proc (cf, &value[2]);
+  if (proc == NULL)
+    return NGX_CONF_ERROR;
+
+  v->get_handler = ngx_stream_guile_variable;
+  v->data = (uintptr_t)proc;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_stream_guile_init_script (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_stream_guile_main_conf_t *gmcf = conf;
+  ngx_str_t *value;
+
+  if (gmcf->init_script.data != NULL)
+    return "is duplicate";
+
+  value = cf->args->elts;
+  gmcf->init_script = value[1];
+
+  if (ngx_conf_full_name (cf->cycle, &gmcf->init_script, 1) != NGX_OK)
+    return NGX_CONF_ERROR;
+
+  // init guile, the runtime is shared with the http module
+  scm_with_guile (ngx_stream_guile_init_scm, &gmcf->init_script);
+
+  return NGX_CONF_OK;
+}
+
+static void *
+ngx_stream_guile_init_scm (void *data)
+{
+  scm_c_define_module (NGX_STREAM_GUILE_MODULE, ngx_stream_guile_init_module,
+                       data);
+
+  return NULL;
+}
+
+static void
+ngx_stream_guile_init_module (void *data)
+{
+  ngx_str_t *script_filename = data;
+
+  // initialize data types
+  ngx_stream_guile_session_scm = scm_make_foreign_object_type (
+      scm_from_utf8_symbol ("ngx-stream-session"),
+      scm_list_1 (scm_from_utf8_symbol ("session")), NULL);
+
+  ngx_stream_guile_sym_again
+      = scm_gc_protect_object (scm_from_utf8_symbol ("again"));
+  ngx_stream_guile_sym_ok
+      = scm_gc_protect_object (scm_from_utf8_symbol ("ok"));
+  ngx_stream_guile_sym_tcp
+      = scm_gc_protect_object (scm_from_utf8_symbol ("tcp"));
+  ngx_stream_guile_sym_udp
+      = scm_gc_protect_object (scm_from_utf8_symbol ("udp"));
+
+  // register functions
+  scm_c_define_gsubr ("ngx-session-preread", 1, 0, 0,
+                      ngx_stream_guile_session_preread);
+  scm_c_define_gsubr ("ngx-session-remote-addr", 1, 0, 0,
+                      ngx_stream_guile_session_remote_addr);
+  scm_c_define_gsubr ("ngx-session-protocol", 1, 0, 0,
+                      ngx_stream_guile_session_protocol);
+  scm_c_define_gsubr ("ngx-session-received", 1, 0, 0,
+                      ngx_stream_guile_session_received);
+  scm_c_define_gsubr ("ngx-session-variable", 2, 0, 0,
+                      ngx_stream_guile_session_variable);
+
+  // export functions in current module
+  scm_c_export ("ngx-session-preread", "ngx-session-remote-addr",
+                "ngx-session-protocol", "ngx-session-received",
+                "ngx-session-variable", NULL);
+
+  // load the script
+  scm_primitive_load (scm_from_locale_stringn ((char *)script_filename->data,
+                                               script_filename->len));
+}
+
+/* Local helpers */
+
+static ngx_stream_session_t *
+unwrap_session (SCM session)
+{
+  scm_assert_foreign_object_type (ngx_stream_guile_session_scm, session);
+
+  ngx_stream_guile_session_t *s = scm_foreign_object_ref (session, 0);
+
+  if (s->session == NULL)
+    scm_misc_error ("unwrap-session", "session already finalized: ~S",
+                    scm_list_1 (session));
+
+  return s->session;
+}
@@ -0,0 +1,137 @@
+#!/usr/bin/env -S guile --no-auto-compile -s
+!#
+;;; Guile NGINX Module
+;;; Copyright (C) 2023-2024 Tommaso Rossi
+;;;
+;;; This file is part of Guile NGINX Module.
+;;;
+;;; This program is free software; you can redistribute it and/or modify
+;;; it under the terms of the GNU General Public License as published by
+;;; the Free Software Foundation; either version 3 of the License, or
+;;; (at your option) any later version.
+;;;
+;;; This program is distributed in the hope that it will be useful,
+;;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;;; GNU General Public License for more details.
+;;;
+;;; You should have received a copy of the GNU General Public License
+;;; along with this program.  If not, see
+;;; <https://www.gnu.org/licenses/>.
+
+;;; Convert guile_trace dumps to the Chrome trace event format:
+;;;
+;;;   guile tools/ngx-guile-trace.scm guile-trace.1234 ... > trace.json
+;;;
+;;; Open trace.json in chrome://tracing or https://ui.perfetto.dev. Each
+;;; worker is a process, each traced request a thread; GC is thread 0.
+;;; Dumps are read in the native byte order, convert them on the host
+;;; that wrote them.
+
+(use-modules (ice-9 binary-ports)
+             (ice-9 format)
+             (ice-9 match)
+             (rnrs bytevectors))
+
+(define endianness (native-endianness))
+
+(define header-size 24)
+(define record-size 16)
+
+(define (read-dump file)
+  (let ((bv (call-with-input-file file get-bytevector-all #:binary #t)))
+    (unless (and (bytevector? bv)
+                 (>= (bytevector-length bv) header-size)
+                 (equal? (utf8->string (subbytevector bv 0 8)) "NGXGTRC1"))
+      (error "not a guile_trace dump:" file))
+    bv))
+
+(define (subbytevector bv start len)
+  (let ((sub (make-bytevector len)))
+    (bytevector-copy! bv start sub 0 len)
+    sub))
+
+;; Span names of the dump and the offset of the first record
+(define (read-names bv count)
+  (let loop ((i 0) (offset header-size) (names '()))
+    (if (= i count)
+        (values (list->vector (reverse names)) offset)
+        (let ((len (bytevector-u16-ref bv offset endianness)))
+          (loop (1+ i)
+                (+ offset 2 len)
+                (cons (utf8->string (subbytevector bv (+ offset 2) len))
+                      names))))))
+
+(define (json-string s)
+  (call-with-output-string
+    (lambda (port)
+      (write-char #\" port)
+      (string-for-each
+       (lambda (c)
+         (case c
+           ((#\" #\\) (write-char #\\ port) (write-char c port))
+           (else (write-char c port))))
+       s)
+      (write-char #\" port))))
+
+(define (phase type)
+  (case type
+    ((1) "B")
+    ((2) "E")
+    (else "i")))
+
+;; Call proc with the time, request, type and name of each record
+(define (for-each-record proc bv)
+  (let ((pid (bytevector-u32-ref bv 8 endianness))
+        (count (bytevector-u32-ref bv 12 endianness))
+        (records (bytevector-u64-ref bv 16 endianness)))
+    (call-with-values (lambda () (read-names bv count))
+      (lambda (names offset)
+        (do ((i 0 (1+ i))
+             (offset offset (+ offset record-size)))
+            ((= i records))
+          (proc pid
+                (bytevector-u64-ref bv offset endianness)
+                (bytevector-u32-ref bv (+ offset 8) endianness)
+                (bytevector-u16-ref bv (+ offset 12) endianness)
+                (vector-ref names
+                            (bytevector-u16-ref bv (+ offset 14)
+                                                endianness))))))))
+
+(define (first-time dumps)
+  (apply min
+         (map (lambda (bv)
+                (let* ((count (bytevector-u32-ref bv 12 endianness))
+                       (records (bytevector-u64-ref bv 16 endianness)))
+                  (if (zero? records)
+                      most-positive-fixnum
+                      (call-with-values (lambda () (read-names bv count))
+                        (lambda (names offset)
+                          (bytevector-u64-ref bv offset endianness))))))
+              dumps)))
+
+(define (convert dumps)
+  (let ((start (first-time dumps))
+        (separator ""))
+    (display "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n")
+    (for-each
+     (lambda (bv)
+       (for-each-record
+        (lambda (pid time request type name)
+          (display separator)
+          (set! separator ",\n")
+          ;; microseconds since the first record of all dumps
+          (format #t "{\"name\":~a,\"ph\":\"~a\",\"ts\":~,3f,\"pid\":~a,\"tid\":~a~a}"
+                  (json-string name) (phase type)
+                  (/ (- time start) 1000.0) pid request
+                  (if (= type 3) ",\"s\":\"t\"" "")))
+        bv))
+     dumps)
+    (display "\n]}\n")))
+
+(match (command-line)
+  ((_ file files ...)
+   (convert (map read-dump (cons file files))))
+  ((program . _)
+   (format (current-error-port) "usage: ~a dump...~%" program)
+   (exit 1)))